@@ -3,21 +3,25 @@
 
 #include "lvalues.h"
 
+/* 断言失败时只捕获错误码和格式化参数，错误信息在打印时才渲染。*/
+#define LASSERT_ERR(args, cond, code, fmt, ...) \
+    if (!(cond)) { lval_t *err = lval_errc(code, fmt, ##__VA_ARGS__); lval_del(args); return err; }
+
 #define LASSERT(args, cond, fmt, ...) \
-    if (!(cond)) { lval_t *err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
+    LASSERT_ERR(args, cond, LERR_OTHER, fmt, ##__VA_ARGS__)
 
 #define LASSERT_TYPE(func, args, index, expect) \
-    LASSERT(args, args->cell[index]->type == expect, \
+    LASSERT_ERR(args, args->cell[index]->type == expect, LERR_ARG_TYPE, \
             "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
             func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
-    LASSERT(args, args->count == num, \
+    LASSERT_ERR(args, args->count == num, LERR_ARG_NUM, \
             "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
             func, args->count, num)
 
 #define LASSERT_NOT_EMPTY(func, args, index) \
-    LASSERT(args, args->cell[index]->count != 0, \
+    LASSERT_ERR(args, args->cell[index]->count != 0, LERR_ARG_EMPTY, \
             "Function '%s' passed {} for argument %i.", func, index);
 
 
@@ -1,13 +1,15 @@
 #include "lbuiltins.h"
-
-extern mpc_parser_t* Lispy;
+#include "lreader.h"
 
 static lval_t *lval_eval_sexpr(lenv_t *e, lval_t *v);
 static lval_t *lval_pop(lval_t *v, int i);
 static lval_t *lval_take(lval_t *v, int i);
+static lval_t *lval_dict_items(lval_t *d);
+static int lval_map_eq(lval_t *x, lval_t *y);
 
 lval_t *builtin_eval(lenv_t *e, lval_t *v);
 lval_t *builtin_list(lenv_t *e, lval_t *v);
+lval_t *builtin_sort(lenv_t *e, lval_t *a);
 
 /**
  * 运算处理入口。
@@ -130,17 +132,16 @@ lval_t *lval_call(lenv_t *e, lval_t *f, lval_t *a) {
  */
 static lval_t *lval_eval_sexpr(lenv_t *e, lval_t *v)
 {
-    /* 遍历子节点，自地向上进行处理。*/
+    /**
+     * 遍历子节点，自地向上进行处理。
+     *  遇到 Err 类型节点立即取走并返回，剩余的兄弟节点不再求值，随 v 一起释放。
+     *  错误沿调用栈逐层直接返回，每层只做一次类型判断，直到被 try/catch 捕获。
+     */
     for (int i=0; i < v->count; i++)
     {
         v->cell[i] = lval_eval(e, v->cell[i]);
-    }
-
-    /* 将所有 Err 类型节点取走。*/
-    for (int i=0; i < v->count; i++)
-    {
         if (LVAL_ERR == v->cell[i]->type)
-        { 
+        {
             return lval_take(v, i);
         }
     }
@@ -221,7 +222,7 @@ lval_t *builtin_op(lenv_t *e, lval_t *v, char *op)
             if (y->num == 0) {
                 lval_del(x);
                 lval_del(y);
-                x = lval_err("Division By Zero!"); break;
+                x = lval_errc(LERR_DIV_ZERO, "Division By Zero!"); break;
             }
             x->num /= y->num;
         }
@@ -418,9 +419,18 @@ int lval_eq(lval_t *x, lval_t *y)
     switch (x->type)
     {
         case LVAL_NUM: return (x->num == y->num);
-        case LVAL_ERR: return (0 == strcmp(x->err, y->err));
+        case LVAL_ERR:
+        {
+            if (x->err->code != y->err->code) { return 0; }
+            char xs[LERR_MSG_MAX], ys[LERR_MSG_MAX];
+            lval_err_str(x, xs, sizeof(xs));
+            lval_err_str(y, ys, sizeof(ys));
+            return (0 == strcmp(xs, ys));
+        }
         case LVAL_SYM: return (0 == strcmp(x->sym, y->sym));
-        case LVAL_STR: return (0 == strcmp(x->str, y->str));
+        case LVAL_STR:
+            if (x->len != y->len) { return 0; }  // 先比较长度
+            return (x->sbuf && x->sbuf == y->sbuf) || (0 == memcmp(x->str, y->str, x->len));
         case LVAL_FUN:
             if (x->builtin || y->builtin)
             {
@@ -439,6 +449,19 @@ int lval_eq(lval_t *x, lval_t *y)
             }
             return 1;
         break;
+        case LVAL_DICT:
+        case LVAL_MAP:
+            return lval_map_eq(x, y);
+        case LVAL_SB:
+        {
+            if (x->len != y->len) { return 0; }
+            lval_t *xs = lval_sb_finish(x);
+            lval_t *ys = lval_sb_finish(y);
+            int rst = lval_eq(xs, ys);
+            lval_del(xs);
+            lval_del(ys);
+            return rst;
+        }
     }
     return 0;
 }
@@ -457,6 +480,79 @@ lval_t *builtin_cmp(lenv_t *e, lval_t *v, char *op)
 lval_t *builtin_eq(lenv_t *e, lval_t *v) { return builtin_cmp(e, v, "=="); }
 lval_t *builtin_ne(lenv_t *e, lval_t *v) { return builtin_cmp(e, v, "!="); }
 
+/**
+ * 全序比较函数。
+ *  不同类型按 enum ltypes 的定义顺序排列，同类型再比较数值、字符串或逐个比较子节点。
+ *  返回负数、0 或正数，分别表示 x 小于、等于或大于 y。
+ */
+int lval_cmp(lval_t *x, lval_t *y)
+{
+    if (x->type != y->type) { return x->type < y->type? -1: 1; }
+
+    switch (x->type)
+    {
+        case LVAL_NUM: return (x->num > y->num) - (x->num < y->num);
+        case LVAL_ERR:
+        {
+            char xs[LERR_MSG_MAX], ys[LERR_MSG_MAX];
+            lval_err_str(x, xs, sizeof(xs));
+            lval_err_str(y, ys, sizeof(ys));
+            return strcmp(xs, ys);
+        }
+        case LVAL_SYM: return strcmp(x->sym, y->sym);
+        case LVAL_STR:
+        {
+            int rst = memcmp(x->str, y->str, x->len < y->len? x->len: y->len);
+            return rst? rst: (x->len > y->len) - (x->len < y->len);
+        }
+        case LVAL_FUN:
+            if (x->builtin && y->builtin)
+            {
+                /* 内建函数之间按函数地址排序 */
+                size_t fx = (size_t)x->builtin, fy = (size_t)y->builtin;
+                return (fx > fy) - (fx < fy);
+            }
+            if (x->builtin || y->builtin)
+            {
+                return x->builtin? -1: 1;  // 内建函数排在自定义函数之前
+            }
+            else
+            {
+                int rst = lval_cmp(x->formals, y->formals);
+                return rst? rst: lval_cmp(x->body, y->body);
+            }
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            for (int i=0; i < x->count && i < y->count; i++)
+            {
+                int rst = lval_cmp(x->cell[i], y->cell[i]);
+                if (rst) { return rst; }
+            }
+            return (x->count > y->count) - (x->count < y->count);
+        case LVAL_DICT:
+        case LVAL_MAP:
+        {
+            /* 槽位顺序与插入历史有关，因此按键排序后的 {k v} 列表进行比较 */
+            lval_t *xs = builtin_sort(NULL, lval_add(lval_sexpr(), lval_dict_items(x)));
+            lval_t *ys = builtin_sort(NULL, lval_add(lval_sexpr(), lval_dict_items(y)));
+            int rst = lval_cmp(xs, ys);
+            lval_del(xs);
+            lval_del(ys);
+            return rst;
+        }
+        case LVAL_SB:
+        {
+            lval_t *xs = lval_sb_finish(x);
+            lval_t *ys = lval_sb_finish(y);
+            int rst = lval_cmp(xs, ys);
+            lval_del(xs);
+            lval_del(ys);
+            return rst;
+        }
+    }
+    return 0;
+}
+
 /**
  * if 关键字函数。
  *  语法规则类型与 C 语言中的三目运算符。
@@ -491,6 +587,699 @@ lval_t *builtin_if(lenv_t *e, lval_t *a)
     return x;
 }
 
+/**
+ * 排序函数集。
+ *  sort 使用 lval_cmp 全序对列表排序，纯数字列表使用 LSD 基数排序；
+ *  sort-by 使用用户提供的比较函数 (f a b)，返回非 0 表示 a 应排在 b 之前。
+ *  除纯数字列表外，均使用内省排序（快速排序 + 堆排序 + 插入排序）。
+ */
+#define LSORT_INSERTION_MAX 16  // 小于该长度的区间使用插入排序
+
+typedef struct
+{
+    lenv_t *env;    // 比较函数的运行环境
+    lval_t *func;   // 用户比较函数，为 NULL 时使用 lval_cmp
+    lval_t *err;    // 比较函数运行出错时记录的错误
+} lsort_ctx_t;
+
+static int lsort_less(lsort_ctx_t *ctx, lval_t *x, lval_t *y)
+{
+    if (NULL == ctx->func) { return lval_cmp(x, y) < 0; }
+    if (ctx->err) { return 0; }  // 已出错，不再调用比较函数，排序尽快结束
+
+    lval_t *args = lval_add(lval_add(lval_sexpr(), lval_copy(x)), lval_copy(y));
+    lval_t *f = lval_copy(ctx->func);  // lval_call 会消耗形参列表，因此每次调用都使用副本
+    lval_t *r = lval_call(ctx->env, f, args);
+    lval_del(f);
+
+    if (LVAL_NUM != r->type)
+    {
+        if (LVAL_ERR == r->type)
+        {
+            ctx->err = r;
+            return 0;
+        }
+        ctx->err = lval_err("Function 'sort-by' comparator returned incorrect type. "
+                            "Got %s, Expected %s.",
+                            ltype_name(r->type), ltype_name(LVAL_NUM));
+        lval_del(r);
+        return 0;
+    }
+
+    int less = (0 != r->num);
+    lval_del(r);
+    return less;
+}
+
+static void lsort_swap(lval_t **v, int i, int j)
+{
+    lval_t *t = v[i]; v[i] = v[j]; v[j] = t;
+}
+
+/* 插入排序，区间 [lo, hi)。*/
+static void lsort_insertion(lsort_ctx_t *ctx, lval_t **v, int lo, int hi)
+{
+    for (int i=lo+1; i < hi; i++)
+    {
+        lval_t *x = v[i];
+        int j = i;
+        while (j > lo && lsort_less(ctx, x, v[j-1]))
+        {
+            v[j] = v[j-1];
+            j--;
+        }
+        v[j] = x;
+    }
+}
+
+static void lsort_sift_down(lsort_ctx_t *ctx, lval_t **v, int root, int n)
+{
+    while (2 * root + 1 < n)
+    {
+        int child = 2 * root + 1;
+        if (child + 1 < n && lsort_less(ctx, v[child], v[child+1])) { child++; }
+        if (!lsort_less(ctx, v[root], v[child])) { return; }
+        lsort_swap(v, root, child);
+        root = child;
+    }
+}
+
+/* 堆排序，区间 [lo, hi)，作为快速排序递归过深时的兜底。*/
+static void lsort_heap(lsort_ctx_t *ctx, lval_t **v, int lo, int hi)
+{
+    lval_t **base = v + lo;
+    int n = hi - lo;
+
+    for (int i=n/2-1; i >= 0; i--)
+    {
+        lsort_sift_down(ctx, base, i, n);
+    }
+    for (int i=n-1; i > 0; i--)
+    {
+        lsort_swap(base, 0, i);
+        lsort_sift_down(ctx, base, 0, i);
+    }
+}
+
+/* 内省排序，区间 [lo, hi)，depth 为剩余的快速排序递归深度。*/
+static void lsort_intro(lsort_ctx_t *ctx, lval_t **v, int lo, int hi, int depth)
+{
+    while (hi - lo > LSORT_INSERTION_MAX)
+    {
+        if (0 == depth)
+        {
+            lsort_heap(ctx, v, lo, hi);
+            return;
+        }
+        depth--;
+
+        /* 三数取中选择枢轴 */
+        int mid = lo + (hi - lo - 1) / 2;
+        if (lsort_less(ctx, v[mid], v[lo]))  { lsort_swap(v, mid, lo); }
+        if (lsort_less(ctx, v[hi-1], v[mid])) { lsort_swap(v, hi-1, mid); }
+        if (lsort_less(ctx, v[mid], v[lo]))  { lsort_swap(v, mid, lo); }
+        lval_t *pivot = v[mid];
+
+        /* Hoare 分区，下标限定在区间内，即使比较函数不满足全序也不会越界 */
+        int i = lo - 1;
+        int j = hi;
+        while (1)
+        {
+            do { i++; } while (i < hi - 1 && lsort_less(ctx, v[i], pivot));
+            do { j--; } while (j > lo && lsort_less(ctx, pivot, v[j]));
+            if (i >= j) { break; }
+            lsort_swap(v, i, j);
+        }
+
+        /* 递归处理较短的一侧，循环处理较长的一侧 */
+        if (j + 1 - lo < hi - j - 1)
+        {
+            lsort_intro(ctx, v, lo, j + 1, depth);
+            lo = j + 1;
+        }
+        else
+        {
+            lsort_intro(ctx, v, j + 1, hi, depth);
+            hi = j + 1;
+        }
+    }
+    lsort_insertion(ctx, v, lo, hi);
+}
+
+static void lsort(lsort_ctx_t *ctx, lval_t **v, int n)
+{
+    int depth = 0;
+    for (int m=n; m > 1; m >>= 1) { depth += 2; }  // 2 * log2(n)
+    lsort_intro(ctx, v, 0, n, depth);
+}
+
+/**
+ * LSD 基数排序，仅用于纯数字列表。
+ *  每轮按 8 bit 分桶，翻转符号位使负数排在正数之前；某一字节全部相同时跳过该轮。
+ *  相同数值保持原有次序。
+ */
+static void lsort_radix(lval_t **v, int n)
+{
+    const unsigned long sign = 1UL << (sizeof(long) * 8 - 1);
+
+    unsigned long *keys = malloc(sizeof(unsigned long) * n);
+    unsigned long *keys_tmp = malloc(sizeof(unsigned long) * n);
+    lval_t **tmp = malloc(sizeof(lval_t *) * n);
+    lval_t **src = v;
+
+    for (int i=0; i < n; i++)
+    {
+        keys[i] = (unsigned long)v[i]->num ^ sign;
+    }
+
+    for (size_t shift=0; shift < sizeof(long) * 8; shift += 8)
+    {
+        int count[256] = {0};
+        for (int i=0; i < n; i++)
+        {
+            count[(keys[i] >> shift) & 0xFF]++;
+        }
+        if (n == count[(keys[0] >> shift) & 0xFF]) { continue; }
+
+        int offset = 0;
+        for (int b=0; b < 256; b++)
+        {
+            int c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+
+        for (int i=0; i < n; i++)
+        {
+            int pos = count[(keys[i] >> shift) & 0xFF]++;
+            keys_tmp[pos] = keys[i];
+            tmp[pos] = src[i];
+        }
+
+        unsigned long *kt = keys; keys = keys_tmp; keys_tmp = kt;
+        lval_t **st = src; src = tmp; tmp = st;
+    }
+
+    if (src != v)
+    {
+        memcpy(v, src, sizeof(lval_t *) * n);
+        tmp = src;
+    }
+
+    free(keys);
+    free(keys_tmp);
+    free(tmp);
+}
+
+lval_t *builtin_sort(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("sort", a, 1);
+    LASSERT_TYPE("sort", a, 0, LVAL_QEXPR);
+
+    lval_t *x = lval_take(a, 0);
+
+    int all_num = 1;
+    for (int i=0; i < x->count && all_num; i++)
+    {
+        all_num = (LVAL_NUM == x->cell[i]->type);
+    }
+
+    if (all_num && x->count > LSORT_INSERTION_MAX)
+    {
+        lsort_radix(x->cell, x->count);
+    }
+    else
+    {
+        lsort_ctx_t ctx = { e, NULL, NULL };
+        lsort(&ctx, x->cell, x->count);
+    }
+    return x;
+}
+
+lval_t *builtin_sort_by(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("sort-by", a, 2);
+    LASSERT_TYPE("sort-by", a, 0, LVAL_FUN);
+    LASSERT_TYPE("sort-by", a, 1, LVAL_QEXPR);
+
+    lsort_ctx_t ctx = { e, a->cell[0], NULL };
+    lsort(&ctx, a->cell[1]->cell, a->cell[1]->count);
+
+    if (ctx.err)
+    {
+        lval_del(a);
+        return ctx.err;
+    }
+    return lval_take(a, 1);
+}
+
+
+/**
+ * 字典函数集。
+ *  支持 dict、hmap、get、has、assoc、dissoc、keys、vals、items 等字典操作。
+ *  dict 创建可变哈希表（LVAL_DICT），hmap 创建持久化映射（LVAL_MAP），其余函数对两者通用。
+ *  键只能是数字、字符串或符号类型。
+ */
+#define LASSERT_KEY(func, args, index) \
+    LASSERT(args, ldict_hashable(args->cell[index]), \
+            "Function '%s' passed unhashable key for argument %i. Got %s, Expected %s, %s or %s.", \
+            func, index, ltype_name(args->cell[index]->type), \
+            ltype_name(LVAL_NUM), ltype_name(LVAL_STR), ltype_name(LVAL_SYM))
+
+#define LASSERT_MAP(func, args, index) \
+    LASSERT(args, LVAL_DICT == args->cell[index]->type || LVAL_MAP == args->cell[index]->type, \
+            "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s or %s.", \
+            func, index, ltype_name(args->cell[index]->type), \
+            ltype_name(LVAL_DICT), ltype_name(LVAL_MAP))
+
+static lval_t *lval_map_get(lval_t *d, lval_t *k)
+{
+    return LVAL_DICT == d->type? ldict_get(d->dict, k): lmap_get(d->map, k);
+}
+
+static int lval_map_count(lval_t *d)
+{
+    return LVAL_DICT == d->type? d->dict->count: d->map->count;
+}
+
+static void lval_map_foreach(lval_t *d, void (*f)(lval_t *, lval_t *, void *), void *data)
+{
+    if (LVAL_MAP == d->type)
+    {
+        lmap_foreach(d->map, f, data);
+        return;
+    }
+
+    for (int i=0; i < d->dict->cap; i++)
+    {
+        ldict_entry_t *entry = &d->dict->entries[i];
+        if (entry->key) { f(entry->key, entry->val, data); }
+    }
+}
+
+/**
+ * 将参数列表中从 start 开始的键值对逐个移入字典，参数列表不再持有这些节点。
+ *  持久化映射在 transient 模式下批量插入，本次新建的节点直接原地修改。
+ */
+static void lval_map_put_pairs(lval_t *d, lval_t *a, int start)
+{
+    if (LVAL_DICT == d->type) { d->dict = ldict_unshare(d->dict); }
+    if (LVAL_MAP == d->type) { lmap_transient_begin(d->map); }
+
+    for (int i=start; i < a->count; i += 2)
+    {
+        if (LVAL_DICT == d->type) { ldict_put(d->dict, a->cell[i], a->cell[i+1]); }
+        else                      { lmap_put(d->map, a->cell[i], a->cell[i+1]); }
+    }
+    a->count = start;
+
+    if (LVAL_MAP == d->type) { lmap_transient_end(d->map); }
+}
+
+static void lval_map_add_key(lval_t *k, lval_t *v, void *x) { lval_add(x, lval_copy(k)); }
+static void lval_map_add_val(lval_t *k, lval_t *v, void *x) { lval_add(x, lval_copy(v)); }
+
+static void lval_map_add_item(lval_t *k, lval_t *v, void *x)
+{
+    lval_t *pair = lval_qexpr();
+    lval_add(pair, lval_copy(k));
+    lval_add(pair, lval_copy(v));
+    lval_add(x, pair);
+}
+
+/* 按存储顺序返回 {{k v} ...} 列表。*/
+static lval_t *lval_dict_items(lval_t *d)
+{
+    lval_t *x = lval_qexpr();
+    lval_map_foreach(d, lval_map_add_item, x);
+    return x;
+}
+
+typedef struct
+{
+    lval_t *other;  // 被比较的字典
+    int equal;      // 目前为止是否相等
+} lval_map_eq_t;
+
+static void lval_map_eq_pair(lval_t *k, lval_t *v, void *data)
+{
+    lval_map_eq_t *ctx = data;
+    if (0 == ctx->equal) { return; }
+
+    lval_t *val = lval_map_get(ctx->other, k);
+    ctx->equal = (NULL != val && lval_eq(v, val));
+}
+
+/* 键值对数目相同且每个键对应的值都相等。*/
+static int lval_map_eq(lval_t *x, lval_t *y)
+{
+    if (lval_map_count(x) != lval_map_count(y)) { return 0; }
+    if (LVAL_MAP == x->type && x->map->root == y->map->root) { return 1; }  // 共享同一棵树
+    if (LVAL_DICT == x->type && x->dict == y->dict) { return 1; }           // 共享同一张表
+
+    lval_map_eq_t ctx = { y, 1 };
+    lval_map_foreach(x, lval_map_eq_pair, &ctx);
+    return ctx.equal;
+}
+
+lval_t *builtin_make_map(lenv_t *e, lval_t *a, char *func)
+{
+    LASSERT(a, (0 == a->count % 2),
+        "Function '%s' passed unpaired arguments. "
+        "Got %i, Expected key value pairs.", func, a->count);
+    for (int i=0; i < a->count; i += 2)
+    {
+        LASSERT_KEY(func, a, i);
+    }
+
+    lval_t *d = (0 == strcmp(func, "dict"))? lval_dict(): lval_map();
+    lval_map_put_pairs(d, a, 0);
+    lval_del(a);
+    return d;
+}
+
+lval_t *builtin_dict(lenv_t *e, lval_t *a) { return builtin_make_map(e, a, "dict"); }
+lval_t *builtin_hmap(lenv_t *e, lval_t *a) { return builtin_make_map(e, a, "hmap"); }
+
+lval_t *builtin_get(lenv_t *e, lval_t *a)
+{
+    LASSERT(a, (2 == a->count || 3 == a->count),
+        "Function 'get' passed incorrect number of arguments. "
+        "Got %i, Expected 2 or 3.", a->count);
+    LASSERT_MAP("get", a, 0);
+    LASSERT_KEY("get", a, 1);
+
+    lval_t *val = lval_map_get(a->cell[0], a->cell[1]);
+    if (val)
+    {
+        val = lval_copy(val);
+    }
+    else if (3 == a->count)
+    {
+        val = lval_pop(a, 2);  // 键不存在时返回默认值
+    }
+    else
+    {
+        lval_del(a);
+        return lval_errc(LERR_NOT_FOUND, "Function 'get' key not found.");
+    }
+
+    lval_del(a);
+    return val;
+}
+
+lval_t *builtin_has(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("has", a, 2);
+    LASSERT_MAP("has", a, 0);
+    LASSERT_KEY("has", a, 1);
+
+    int rst = (NULL != lval_map_get(a->cell[0], a->cell[1]));
+    lval_del(a);
+    return lval_num(rst);
+}
+
+lval_t *builtin_assoc(lenv_t *e, lval_t *a)
+{
+    LASSERT(a, (1 == a->count % 2),
+        "Function 'assoc' passed unpaired arguments. "
+        "Got %i, Expected dictionary followed by key value pairs.", a->count);
+    LASSERT_MAP("assoc", a, 0);
+    for (int i=1; i < a->count; i += 2)
+    {
+        LASSERT_KEY("assoc", a, i);
+    }
+
+    /* 参数是求值得到的副本：字典与其他副本共享表时先复制一份再修改，持久化映射只复制修改路径上的节点 */
+    lval_map_put_pairs(a->cell[0], a, 1);
+    return lval_take(a, 0);
+}
+
+lval_t *builtin_dissoc(lenv_t *e, lval_t *a)
+{
+    LASSERT_ERR(a, a->count >= 1, LERR_ARG_NUM,
+        "Function 'dissoc' passed incorrect number of arguments. "
+        "Got %i, Expected dictionary followed by keys.", a->count);
+    LASSERT_MAP("dissoc", a, 0);
+    for (int i=1; i < a->count; i++)
+    {
+        LASSERT_KEY("dissoc", a, i);
+    }
+
+    lval_t *d = a->cell[0];
+    if (LVAL_DICT == d->type) { d->dict = ldict_unshare(d->dict); }
+    for (int i=1; i < a->count; i++)
+    {
+        if (LVAL_DICT == d->type) { ldict_remove(d->dict, a->cell[i]); }
+        else                      { lmap_remove(d->map, a->cell[i]); }
+    }
+    return lval_take(a, 0);
+}
+
+lval_t *builtin_dict_list(lenv_t *e, lval_t *a, char *func)
+{
+    LASSERT_NUM(func, a, 1);
+    LASSERT_MAP(func, a, 0);
+
+    lval_t *x = lval_qexpr();
+    if (0 == strcmp(func, "keys"))  { lval_map_foreach(a->cell[0], lval_map_add_key, x); }
+    if (0 == strcmp(func, "vals"))  { lval_map_foreach(a->cell[0], lval_map_add_val, x); }
+    if (0 == strcmp(func, "items")) { lval_map_foreach(a->cell[0], lval_map_add_item, x); }
+
+    lval_del(a);
+    return x;
+}
+
+lval_t *builtin_keys(lenv_t *e, lval_t *a)  { return builtin_dict_list(e, a, "keys"); }
+lval_t *builtin_vals(lenv_t *e, lval_t *a)  { return builtin_dict_list(e, a, "vals"); }
+lval_t *builtin_items(lenv_t *e, lval_t *a) { return builtin_dict_list(e, a, "items"); }
+
+
+/**
+ * 字符串函数集。
+ *  支持 str-len、substr、str-concat、str-find、str-split、str-replace、str-join、
+ *  str->num、num->str 等字符串操作。
+ */
+lval_t *builtin_str_len(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("str-len", a, 1);
+    LASSERT_TYPE("str-len", a, 0, LVAL_STR);
+
+    long len = a->cell[0]->len;
+    lval_del(a);
+    return lval_num(len);
+}
+
+lval_t *builtin_substr(lenv_t *e, lval_t *a)
+{
+    LASSERT(a, (2 == a->count || 3 == a->count),
+        "Function 'substr' passed incorrect number of arguments. "
+        "Got %i, Expected 2 or 3.", a->count);
+    LASSERT_TYPE("substr", a, 0, LVAL_STR);
+    LASSERT_TYPE("substr", a, 1, LVAL_NUM);
+
+    lval_t *s = a->cell[0];
+    long start = a->cell[1]->num;
+    LASSERT(a, (start >= 0 && start <= (long)s->len),
+        "Function 'substr' start index out of range. "
+        "Got %li, Expected 0 to %li.", start, (long)s->len);
+
+    long len = s->len - start;
+    if (3 == a->count)
+    {
+        LASSERT_TYPE("substr", a, 2, LVAL_NUM);
+        LASSERT(a, (a->cell[2]->num >= 0),
+            "Function 'substr' passed negative length %li.", a->cell[2]->num);
+        if (a->cell[2]->num < len) { len = a->cell[2]->num; }  // 超出结尾时截断
+    }
+
+    lval_t *x = lval_str_n(s->str + start, len);
+    lval_del(a);
+    return x;
+}
+
+lval_t *builtin_str_concat(lenv_t *e, lval_t *a)
+{
+    for (int i=0; i < a->count; i++)
+    {
+        LASSERT_TYPE("str-concat", a, i, LVAL_STR);
+    }
+
+    lval_t *x = lval_str_concat(a->cell, a->count, NULL);
+    lval_del(a);
+    return x;
+}
+
+lval_t *builtin_str_join(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("str-join", a, 2);
+    LASSERT_TYPE("str-join", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-join", a, 1, LVAL_QEXPR);
+
+    lval_t *l = a->cell[1];
+    for (int i=0; i < l->count; i++)
+    {
+        LASSERT(a, (LVAL_STR == l->cell[i]->type),
+            "Function 'str-join' passed non-string element %i. Got %s, Expected %s.",
+            i, ltype_name(l->cell[i]->type), ltype_name(LVAL_STR));
+    }
+
+    lval_t *x = lval_str_concat(l->cell, l->count, a->cell[0]);
+    lval_del(a);
+    return x;
+}
+
+lval_t *builtin_str_find(lenv_t *e, lval_t *a)
+{
+    LASSERT(a, (2 == a->count || 3 == a->count),
+        "Function 'str-find' passed incorrect number of arguments. "
+        "Got %i, Expected 2 or 3.", a->count);
+    LASSERT_TYPE("str-find", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-find", a, 1, LVAL_STR);
+
+    lval_t *s = a->cell[0];
+    long start = 0;
+    if (3 == a->count)
+    {
+        LASSERT_TYPE("str-find", a, 2, LVAL_NUM);
+        start = a->cell[2]->num;
+        LASSERT(a, (start >= 0 && start <= (long)s->len),
+            "Function 'str-find' start index out of range. "
+            "Got %li, Expected 0 to %li.", start, (long)s->len);
+    }
+
+    long found = lstr_find(s->str + start, s->len - start, a->cell[1]->str, a->cell[1]->len);
+    lval_del(a);
+    return lval_num(found < 0? -1: start + found);
+}
+
+lval_t *builtin_str_split(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("str-split", a, 2);
+    LASSERT_TYPE("str-split", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-split", a, 1, LVAL_STR);
+    LASSERT(a, (a->cell[1]->len > 0), "Function '%s' passed empty separator.", "str-split");
+
+    lval_t *x = lval_str_split(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return x;
+}
+
+lval_t *builtin_str_replace(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("str-replace", a, 3);
+    LASSERT_TYPE("str-replace", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-replace", a, 1, LVAL_STR);
+    LASSERT_TYPE("str-replace", a, 2, LVAL_STR);
+    LASSERT(a, (a->cell[1]->len > 0), "Function '%s' passed empty pattern.", "str-replace");
+
+    lval_t *x = lval_str_replace(a->cell[0], a->cell[1], a->cell[2]);
+    lval_del(a);
+    return x;
+}
+
+lval_t *builtin_str_to_num(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("str->num", a, 1);
+    LASSERT_TYPE("str->num", a, 0, LVAL_STR);
+
+    char *end;
+    errno = 0;
+    long x = strtol(a->cell[0]->str, &end, 10);
+    LASSERT(a, (0 != a->cell[0]->len && end == a->cell[0]->str + a->cell[0]->len && ERANGE != errno),
+        "Function 'str->num' passed invalid number \"%s\".", a->cell[0]->str);
+
+    lval_del(a);
+    return lval_num(x);
+}
+
+lval_t *builtin_num_to_str(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("num->str", a, 1);
+    LASSERT_TYPE("num->str", a, 0, LVAL_NUM);
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%li", a->cell[0]->num);
+    lval_del(a);
+    return lval_str_n(buf, len);
+}
+
+
+/**
+ * 字符串构建器函数集。
+ *  sb-new 创建构建器（可带初始片段），sb-append 追加字符串或其他构建器的片段，
+ *  sb-finish 将所有片段拼接为字符串。追加均摊 O(1)，只有 sb-finish 时才拼接。
+ */
+static lval_t *lval_sb_append_args(lval_t *b, lval_t *a, int start, char *func)
+{
+    for (int i=start; i < a->count; i++)
+    {
+        LASSERT(a, (LVAL_STR == a->cell[i]->type || LVAL_SB == a->cell[i]->type),
+            "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s or %s.",
+            func, i, ltype_name(a->cell[i]->type), ltype_name(LVAL_STR), ltype_name(LVAL_SB));
+    }
+
+    for (int i=start; i < a->count; i++)
+    {
+        lval_t *x = a->cell[i];
+        if (LVAL_STR == x->type)
+        {
+            lval_sb_append(b, x);
+            a->cell[i] = NULL;
+            continue;
+        }
+
+        for (int j=0; j < x->sb_count; j++)
+        {
+            lval_sb_append(b, lval_copy(x->sb->pieces[j]));
+        }
+    }
+
+    /* 已移入构建器的字符串不再由参数列表释放 */
+    int n = start;
+    for (int i=start; i < a->count; i++)
+    {
+        if (a->cell[i]) { a->cell[n++] = a->cell[i]; }
+    }
+    a->count = n;
+    return NULL;
+}
+
+lval_t *builtin_sb_new(lenv_t *e, lval_t *a)
+{
+    lval_t *b = lval_sb();
+    lval_t *err = lval_sb_append_args(b, a, 0, "sb-new");
+    if (err)
+    {
+        lval_del(b);
+        return err;
+    }
+
+    lval_del(a);
+    return b;
+}
+
+lval_t *builtin_sb_append(lenv_t *e, lval_t *a)
+{
+    LASSERT_TYPE("sb-append", a, 0, LVAL_SB);
+
+    lval_t *err = lval_sb_append_args(a->cell[0], a, 1, "sb-append");
+    if (err) { return err; }
+
+    return lval_take(a, 0);
+}
+
+lval_t *builtin_sb_finish(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("sb-finish", a, 1);
+    LASSERT_TYPE("sb-finish", a, 0, LVAL_SB);
+
+    lval_t *x = lval_sb_finish(a->cell[0]);
+    lval_del(a);
+    return x;
+}
+
+
 /**
  * 源文件加载函数。
  */
@@ -500,22 +1289,21 @@ lval_t *builtin_load(lenv_t *e, lval_t *a)
     LASSERT_TYPE("load", a, 0, LVAL_STR);
 
     /* Parse File given by string name */
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, Lispy, &r))
+    char *err_msg = NULL;
+    lval_t *expr = lread_file(a->cell[0]->str, &err_msg);
+    if (expr)
     {
-        /* Read contents */
-        lval_t *expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
-
-        while (expr->count)
+        /* 按顺序求值每个顶层表达式，所有权逐个移交给 lval_eval，避免每次从头部弹出的移动开销。*/
+        for (int i=0; i < expr->count; i++)
         {
-            lval_t *x = lval_eval(e, lval_pop(expr, 0));
+            lval_t *x = lval_eval(e, expr->cell[i]);
 
             /* If Evaluation leads to error print it */
             if (LVAL_ERR == x->type) { lval_println(x); }
             lval_del(x);
         }
 
+        expr->count = 0;
         lval_del(expr);
         lval_del(a);
 
@@ -524,12 +1312,8 @@ lval_t *builtin_load(lenv_t *e, lval_t *a)
     }
     else
     {
-         /* Get Parse Error as String */
-        char *err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
-
         /* Create new error message using it */
-        lval_t *err = lval_err("Could not load file %s", err_msg);
+        lval_t *err = lval_errc(LERR_LOAD, "Could not load file %s", err_msg);
 
         free(err_msg);
         lval_del(a);
@@ -548,11 +1332,24 @@ lval_t *builtin_print(lenv_t *e, lval_t *a)
   /* Print each argument followed by a space */
   for (int i=0; i < a->count; i++)
   {
-    lval_print(a->cell[i]); putchar(' ');
+    lval_print(a->cell[i]); lval_print_char(' ');
   }
 
   /* Print a newline and delete arguments */
-  putchar('\n');
+  lval_print_char('\n');
+  lval_del(a);
+  return lval_sexpr();
+}
+
+
+/**
+ * flush 关键字函数
+ * 	将输出缓冲区中的内容写到 stdout。
+ * 	函数返回空表达式。
+ */
+lval_t *builtin_flush(lenv_t *e, lval_t *a)
+{
+  lval_print_flush();
   lval_del(a);
   return lval_sexpr();
 }
@@ -568,13 +1365,75 @@ lval_t *builtin_error(lenv_t *e, lval_t *a)
   LASSERT_TYPE("error", a, 0, LVAL_STR);
 
   /* Construct Error from first argument */
-  lval_t *err = lval_err(a->cell[0]->str);
+  lval_t *err = lval_errc(LERR_USER, "%s", a->cell[0]->str);
 
   /* Delete arguments and return */
   lval_del(a);
   return err;
 }
 
+/* 将错误信息渲染为字符串。*/
+static lval_t *lval_err_msg(lval_t *err)
+{
+    char buf[LERR_MSG_MAX];
+    size_t n = lval_err_str(err, buf, sizeof(buf));
+    return lval_str_n(buf, n);
+}
+
+/**
+ * try 错误处理函数
+ *  (try {body} handler) 对 body 求值，出错时以错误码和错误信息两个参数调用 handler，
+ *  并返回 handler 的结果；未出错时直接返回 body 的结果。
+ */
+lval_t *builtin_try(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("try", a, 2);
+    LASSERT_TYPE("try", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("try", a, 1, LVAL_FUN);
+
+    lval_t *r = builtin_eval(e, lval_add(lval_sexpr(), lval_pop(a, 0)));
+    if (LVAL_ERR != r->type)
+    {
+        lval_del(a);
+        return r;
+    }
+
+    lval_t *f = lval_take(a, 0);
+    lval_t *args = lval_sexpr();
+    lval_add(args, lval_num(r->err->code));
+    lval_add(args, lval_err_msg(r));
+    lval_del(r);
+
+    lval_t *result = lval_call(e, f, args);
+    lval_del(f);
+    return result;
+}
+
+/**
+ * catch 错误捕获函数
+ *  (catch {body}) 对 body 求值，出错时返回 {错误码 错误信息}，未出错时返回 {0 结果}。
+ */
+lval_t *builtin_catch(lenv_t *e, lval_t *a)
+{
+    LASSERT_NUM("catch", a, 1);
+    LASSERT_TYPE("catch", a, 0, LVAL_QEXPR);
+
+    lval_t *r = builtin_eval(e, a);
+    lval_t *q = lval_qexpr();
+    if (LVAL_ERR == r->type)
+    {
+        lval_add(q, lval_num(r->err->code));
+        lval_add(q, lval_err_msg(r));
+        lval_del(r);
+    }
+    else
+    {
+        lval_add(q, lval_num(LERR_NONE));
+        lval_add(q, r);
+    }
+    return q;
+}
+
 
 /**
  * 函数路由器注册函数。
@@ -597,7 +1456,10 @@ void lenv_add_builtins(lenv_t *e)
     /* File load Functions */
     lenv_add_builtin(e, "load",  builtin_load);
     lenv_add_builtin(e, "error", builtin_error);
+    lenv_add_builtin(e, "try",   builtin_try);
+    lenv_add_builtin(e, "catch", builtin_catch);
     lenv_add_builtin(e, "print", builtin_print);
+    lenv_add_builtin(e, "flush", builtin_flush);
 
     /* Comparison Functions */
     lenv_add_builtin(e, "if", builtin_if);
@@ -619,6 +1481,35 @@ void lenv_add_builtins(lenv_t *e)
     lenv_add_builtin(e, "tail", builtin_tail);
     lenv_add_builtin(e, "eval", builtin_eval);
     lenv_add_builtin(e, "join", builtin_join);
+    lenv_add_builtin(e, "sort", builtin_sort);
+    lenv_add_builtin(e, "sort-by", builtin_sort_by);
+
+    /* Dictionary Functions */
+    lenv_add_builtin(e, "dict",   builtin_dict);
+    lenv_add_builtin(e, "hmap",   builtin_hmap);
+    lenv_add_builtin(e, "get",    builtin_get);
+    lenv_add_builtin(e, "has",    builtin_has);
+    lenv_add_builtin(e, "assoc",  builtin_assoc);
+    lenv_add_builtin(e, "dissoc", builtin_dissoc);
+    lenv_add_builtin(e, "keys",   builtin_keys);
+    lenv_add_builtin(e, "vals",   builtin_vals);
+    lenv_add_builtin(e, "items",  builtin_items);
+
+    /* String Functions */
+    lenv_add_builtin(e, "str-len",     builtin_str_len);
+    lenv_add_builtin(e, "substr",      builtin_substr);
+    lenv_add_builtin(e, "str-concat",  builtin_str_concat);
+    lenv_add_builtin(e, "str-find",    builtin_str_find);
+    lenv_add_builtin(e, "str-split",   builtin_str_split);
+    lenv_add_builtin(e, "str-replace", builtin_str_replace);
+    lenv_add_builtin(e, "str-join",    builtin_str_join);
+    lenv_add_builtin(e, "str->num",    builtin_str_to_num);
+    lenv_add_builtin(e, "num->str",    builtin_num_to_str);
+
+    /* String Builder Functions */
+    lenv_add_builtin(e, "sb-new",    builtin_sb_new);
+    lenv_add_builtin(e, "sb-append", builtin_sb_append);
+    lenv_add_builtin(e, "sb-finish", builtin_sb_finish);
 
     /* Mathematical Functions */
     lenv_add_builtin(e, "+", builtin_add);
@@ -0,0 +1,292 @@
+#ifndef _WIN32
+#define _DEFAULT_SOURCE
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mpc.h"
+
+#include "lcache.h"
+#include "limage.h"
+
+
+char *lcache_dir = NULL;
+
+/**
+ * 缓存目录中的两类文件。
+ *  <内容哈希>.lfc  表达式文件，文件头之后是 limage_encode 编码的 S-Expression。
+ *  <路径哈希>.lfi  路径索引，记录文件的大小、修改时间、inode 与内容哈希，文件头之后是绝对路径。
+ *  写入时先写临时文件再重命名，多个进程同时加载同一文件时不会读到写了一半的缓存。
+ */
+#define LCACHE_VERSION 1
+
+#define LCACHE_FORM_MAGIC  "LSPYFRM"
+#define LCACHE_INDEX_MAGIC "LSPYIDX"
+
+typedef struct
+{
+    char magic[8];
+    unsigned long long version;  // LCACHE_VERSION 与 LIMAGE_VERSION 的组合
+    unsigned long long hash[2];  // 内容哈希，防止文件被改名或截断
+    unsigned long long len;      // 编码后的表达式长度
+    unsigned long long check;    // 编码后的表达式的哈希，缓存文件损坏时不再解码
+} lcache_form_t;
+
+typedef struct
+{
+    char magic[8];
+    unsigned long long version;
+    unsigned long long size;
+    unsigned long long mtime;
+    unsigned long long ino;
+    unsigned long long hash[2];
+    unsigned long long path_len;  // 绝对路径长度，用于排除路径哈希冲突
+} lcache_index_t;
+
+#define LCACHE_VERSION_TAG ((unsigned long long)LCACHE_VERSION << 32 | LIMAGE_VERSION)
+
+#ifndef _WIN32
+
+static unsigned long long lcache_mix(unsigned long long x)
+{
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * 128 位内容哈希。
+ *  两路累加器以不同的方式按 8 字节分组吸收输入，末尾不足 8 字节时补零，长度参与最终混合。
+ *  不是密码学哈希，只用于识别本机上的文件内容。
+ */
+static void lcache_hash(const char *s, size_t len, unsigned long long h[2])
+{
+    unsigned long long a = 0x9e3779b97f4a7c15ULL, b = 0xc2b2ae3d27d4eb4fULL;
+
+    for (size_t i = 0; i < len; i += 8)
+    {
+        unsigned long long x = 0;
+        memcpy(&x, s + i, len - i < 8? len - i: 8);
+
+        a = (a ^ x) * 0xff51afd7ed558ccdULL;
+        a ^= a >> 29;
+        b = (b + x) * 0xc4ceb9fe1a85ec53ULL;
+        b = (b << 31) | (b >> 33);
+    }
+
+    h[0] = lcache_mix(a ^ len);
+    h[1] = lcache_mix(b + lcache_mix(a) + len);
+}
+
+static unsigned long long lcache_hash_str(const char *s)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;  // FNV-1a
+    for (; *s; s++)
+    {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ULL;
+    }
+    return lcache_mix(h);
+}
+
+static char *lcache_path(const char *fmt, unsigned long long x, unsigned long long y)
+{
+    size_t n = strlen(lcache_dir) + 48;
+    char *path = malloc(n);
+    snprintf(path, n, fmt, lcache_dir, x, y);
+    return path;
+}
+
+static char *lcache_form_path(lcache_key_t *k)
+{
+    return lcache_path("%s/%016llx%016llx.lfc", k->hash[0], k->hash[1]);
+}
+
+static char *lcache_index_path(lcache_key_t *k)
+{
+    return lcache_path("%s/%016llx.lfi", k->path, 0ULL);
+}
+
+/* 先写入同目录下的临时文件，再重命名为目标文件。*/
+static void lcache_write(const char *path, const void *head, size_t head_len, const void *body, size_t body_len)
+{
+    size_t n = strlen(path) + 32;
+    char *tmp = malloc(n);
+    snprintf(tmp, n, "%s.%ld.tmp", path, (long)getpid());
+
+    FILE *f = fopen(tmp, "wb");
+    if (NULL == f)
+    {
+        mkdir(lcache_dir, 0777);
+        f = fopen(tmp, "wb");
+    }
+
+    int ok = f && fwrite(head, 1, head_len, f) == head_len && fwrite(body, 1, body_len, f) == body_len;
+    if (f && 0 != fclose(f)) { ok = 0; }
+
+    if (!ok || 0 != rename(tmp, path)) { remove(tmp); }
+    free(tmp);
+}
+
+/**
+ * 写入路径索引。
+ *  修改时间距今不足 2 秒时不写入：同一秒内再次修改且大小不变的文件无法通过修改时间区分。
+ */
+static void lcache_store_index(lcache_key_t *k)
+{
+    if (!k->stat_ok || (long long)k->mtime + 2 > (long long)time(NULL)) { return; }
+
+    lcache_index_t x;
+    memset(&x, 0, sizeof(x));
+    memcpy(x.magic, LCACHE_INDEX_MAGIC, sizeof(x.magic));
+    x.version = LCACHE_VERSION_TAG;
+    x.size = k->size;
+    x.mtime = k->mtime;
+    x.ino = k->ino;
+    x.hash[0] = k->hash[0];
+    x.hash[1] = k->hash[1];
+    x.path_len = strlen(k->realpath);
+
+    char *path = lcache_index_path(k);
+    lcache_write(path, &x, sizeof(x), k->realpath, x.path_len);
+    free(path);
+}
+
+/* 按 k->hash 读取表达式文件。*/
+static lval_t *lcache_load_form(lcache_key_t *k)
+{
+    char *path = lcache_form_path(k);
+    size_t len;
+    char *buf = mpc_map_file(path, &len);
+    free(path);
+    if (NULL == buf) { return NULL; }
+
+    lval_t *v = NULL;
+    lcache_form_t x;
+    if (len >= sizeof(x))
+    {
+        memcpy(&x, buf, sizeof(x));
+        if (0 == memcmp(x.magic, LCACHE_FORM_MAGIC, sizeof(x.magic)) && LCACHE_VERSION_TAG == x.version
+            && x.hash[0] == k->hash[0] && x.hash[1] == k->hash[1] && x.len == len - sizeof(x))
+        {
+            unsigned long long h[2];
+            lcache_hash(buf + sizeof(x), x.len, h);
+            v = h[0] == x.check? limage_decode(buf + sizeof(x), x.len): NULL;
+            if (v && LVAL_SEXPR != v->type)
+            {
+                lval_del(v);
+                v = NULL;
+            }
+        }
+    }
+
+    mpc_unmap_file(buf, len);
+    return v;
+}
+
+lval_t *lcache_find_stat(lcache_key_t *k, const char *filename)
+{
+    memset(k, 0, sizeof(*k));
+    if (NULL == lcache_dir) { return NULL; }
+
+    /* 只缓存普通文件，管道等输入每次读到的内容可能不同。*/
+    struct stat st;
+    if (0 != stat(filename, &st) || !S_ISREG(st.st_mode)) { return NULL; }
+
+    k->realpath = realpath(filename, NULL);
+    if (NULL == k->realpath) { return NULL; }
+
+    k->enabled = 1;
+    k->stat_ok = 1;
+    k->size = (unsigned long long)st.st_size;
+    k->mtime = (unsigned long long)st.st_mtime;
+    k->ino = (unsigned long long)st.st_ino;
+    k->path = lcache_hash_str(k->realpath);
+
+    char *path = lcache_index_path(k);
+    size_t len;
+    char *buf = mpc_map_file(path, &len);
+    free(path);
+    if (NULL == buf) { return NULL; }
+
+    lval_t *v = NULL;
+    lcache_index_t x;
+    if (len >= sizeof(x))
+    {
+        memcpy(&x, buf, sizeof(x));
+        if (0 == memcmp(x.magic, LCACHE_INDEX_MAGIC, sizeof(x.magic)) && LCACHE_VERSION_TAG == x.version
+            && x.size == k->size && x.mtime == k->mtime && x.ino == k->ino
+            && x.path_len == len - sizeof(x) && 0 == memcmp(buf + sizeof(x), k->realpath, x.path_len))
+        {
+            k->hash[0] = x.hash[0];
+            k->hash[1] = x.hash[1];
+            v = lcache_load_form(k);
+        }
+    }
+
+    mpc_unmap_file(buf, len);
+    return v;
+}
+
+lval_t *lcache_find(lcache_key_t *k, const char *input, size_t len)
+{
+    if (!k->enabled) { return NULL; }
+
+    lcache_hash(input, len, k->hash);
+    lval_t *v = lcache_load_form(k);
+    if (v) { lcache_store_index(k); }
+    return v;
+}
+
+void lcache_store(lcache_key_t *k, lval_t *v)
+{
+    if (!k->enabled) { return; }
+
+    lcache_form_t x;
+    memset(&x, 0, sizeof(x));
+    memcpy(x.magic, LCACHE_FORM_MAGIC, sizeof(x.magic));
+    x.version = LCACHE_VERSION_TAG;
+    x.hash[0] = k->hash[0];
+    x.hash[1] = k->hash[1];
+
+    size_t len;
+    char *buf = limage_encode(v, &len);
+    if (NULL == buf) { return; }
+
+    unsigned long long h[2];
+    lcache_hash(buf, len, h);
+    x.len = len;
+    x.check = h[0];
+
+    char *path = lcache_form_path(k);
+    lcache_write(path, &x, sizeof(x), buf, len);
+    free(path);
+    free(buf);
+
+    lcache_store_index(k);
+}
+
+void lcache_done(lcache_key_t *k)
+{
+    free(k->realpath);
+}
+
+#else
+
+lval_t *lcache_find_stat(lcache_key_t *k, const char *filename)
+{
+    memset(k, 0, sizeof(*k));
+    return NULL;
+}
+
+lval_t *lcache_find(lcache_key_t *k, const char *input, size_t len) { return NULL; }
+void lcache_store(lcache_key_t *k, lval_t *v) {}
+void lcache_done(lcache_key_t *k) {}
+
+#endif
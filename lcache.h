@@ -0,0 +1,53 @@
+/*******
+ * Lispy Cache 编译缓存模块。
+ *  load 读取源文件后将得到的表达式以二进制格式保存在缓存目录中，以文件内容的哈希为键，
+ *  再次加载内容相同的文件时直接解码，不再经过读取器或 mpc。
+ *  另外按文件路径记录文件的大小、修改时间与内容哈希，三者未变化时连源文件都不必读取。
+ */
+#ifndef lcache_h
+#define lcache_h
+
+#include "lvalues.h"
+
+
+/* 头文件循环嵌套，前置声明。*/
+#ifndef predefinition
+#define predefinition
+struct lenv_s;
+typedef struct lenv_s lenv_t;
+struct lval_s;
+typedef struct lval_s lval_t;
+typedef lval_t *(*lbuiltin)(lenv_t*, lval_t*);  // 路由器函数指针类型
+#endif
+
+
+extern char *lcache_dir;  // 缓存目录，为 NULL 时不使用缓存，LISPY_CACHE_DIR 环境变量或 --cache-dir=DIR 命令行参数
+
+/* 一次 load 的缓存键 */
+typedef struct
+{
+    int    enabled;             // 是否使用缓存
+    int    stat_ok;             // 已取得文件的大小与修改时间
+    unsigned long long size;    // 文件大小
+    unsigned long long mtime;   // 文件修改时间
+    unsigned long long ino;     // 文件 inode
+    unsigned long long path;    // 文件绝对路径的哈希
+    unsigned long long hash[2]; // 文件内容的 128 位哈希，lcache_find 之后有效
+    char   *realpath;           // 文件绝对路径
+} lcache_key_t;
+
+/**
+ * 按文件大小与修改时间预检查，命中时返回缓存的表达式，不读取源文件。
+ *  未命中时返回 NULL，之后应使用 lcache_find 按内容查找，最后以 lcache_done 释放缓存键。
+ */
+lval_t *lcache_find_stat(lcache_key_t *k, const char *filename);
+
+/* 按文件内容的哈希查找，未命中时返回 NULL。*/
+lval_t *lcache_find(lcache_key_t *k, const char *input, size_t len);
+
+/* 保存读取结果，不接管 v 的所有权。*/
+void lcache_store(lcache_key_t *k, lval_t *v);
+
+void lcache_done(lcache_key_t *k);
+
+#endif
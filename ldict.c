@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ldict.h"
+#include "lenv.h"
+
+#define LDICT_CAP_MIN 8  // 非空字典的最小槽位数目
+
+
+/**
+ * 构造函数，空字典不分配槽位。
+ */
+ldict_t *ldict_new(void)
+{
+    ldict_t *d = malloc(sizeof(ldict_t));
+    d->refs = 1;
+    d->count = 0;
+    d->cap = 0;
+    d->entries = NULL;
+    return d;
+}
+
+/**
+ * 析构函数，最后一个引用释放时同时释放所有键值。
+ */
+void ldict_del(ldict_t *d)
+{
+    if (--d->refs > 0) { return; }
+
+    for (int i=0; i < d->cap; i++)
+    {
+        if (d->entries[i].key)
+        {
+            lval_del(d->entries[i].key);
+            lval_del(d->entries[i].val);
+        }
+    }
+    free(d->entries);
+    free(d);
+}
+
+ldict_t *ldict_copy(ldict_t *d)
+{
+    d->refs++;
+    return d;
+}
+
+/**
+ * 共享的表在写入前深拷贝一份。槽位数目不变，因此每个键值对保持在原来的槽位上，无需重新哈希。
+ */
+ldict_t *ldict_unshare(ldict_t *d)
+{
+    if (1 == d->refs) { return d; }
+    d->refs--;
+
+    ldict_t *n = malloc(sizeof(ldict_t));
+    n->refs = 1;
+    n->count = d->count;
+    n->cap = d->cap;
+    n->entries = d->cap? calloc(d->cap, sizeof(ldict_entry_t)): NULL;
+
+    for (int i=0; i < d->cap; i++)
+    {
+        if (d->entries[i].key)
+        {
+            n->entries[i].hash = d->entries[i].hash;
+            n->entries[i].key = lval_copy(d->entries[i].key);
+            n->entries[i].val = lval_copy(d->entries[i].val);
+        }
+    }
+    return n;
+}
+
+
+/**
+ * 只有数字、字符串和符号可以作为字典的键。
+ */
+int ldict_hashable(lval_t *k)
+{
+    return LVAL_NUM == k->type || LVAL_STR == k->type || LVAL_SYM == k->type;
+}
+
+static unsigned long long lhash_mix(unsigned long long x)
+{
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static unsigned long long lhash_str(const char *s, size_t len, unsigned long long seed)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL ^ seed;  // FNV-1a
+    for (size_t i=0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return lhash_mix(h);
+}
+
+/**
+ * 结构化哈希函数，类型参与哈希计算，因此字符串 "a" 与符号 a 的哈希值不同。
+ */
+unsigned long long lval_hash(lval_t *k)
+{
+    switch (k->type)
+    {
+        case LVAL_NUM: return lhash_mix((unsigned long long)k->num ^ LVAL_NUM);
+        case LVAL_STR: return lhash_str(k->str, k->len, LVAL_STR);
+        case LVAL_SYM: return lhash_str(k->sym, strlen(k->sym), LVAL_SYM);
+    }
+    return 0;
+}
+
+int ldict_key_eq(lval_t *x, lval_t *y)
+{
+    if (x->type != y->type) { return 0; }
+
+    switch (x->type)
+    {
+        case LVAL_NUM: return x->num == y->num;
+        case LVAL_STR: return x->len == y->len && 0 == memcmp(x->str, y->str, x->len);
+        case LVAL_SYM: return 0 == strcmp(x->sym, y->sym);
+    }
+    return 0;
+}
+
+/* 槽位 idx 上的元素距离其理想槽位的探测距离。*/
+static int ldict_dist(ldict_t *d, int idx)
+{
+    return (idx - (int)(d->entries[idx].hash & (d->cap - 1))) & (d->cap - 1);
+}
+
+/**
+ * 查找键所在的槽位，不存在时返回 -1。
+ *  Robin Hood 哈希保证探测链上的距离单调，遇到距离更小的元素即可提前结束查找。
+ */
+static int ldict_find(ldict_t *d, lval_t *k, unsigned long long hash)
+{
+    if (0 == d->count) { return -1; }
+
+    int mask = d->cap - 1;
+    int idx = hash & mask;
+
+    for (int dist=0; ; dist++, idx = (idx + 1) & mask)
+    {
+        ldict_entry_t *slot = &d->entries[idx];
+        if (NULL == slot->key) { return -1; }
+        if (ldict_dist(d, idx) < dist) { return -1; }
+        if (slot->hash == hash && ldict_key_eq(slot->key, k)) { return idx; }
+    }
+}
+
+/**
+ * 插入一个确定不存在的键值对。
+ *  沿探测链前进时，如果当前槽位元素的探测距离比待插入元素短，则交换两者继续插入。
+ */
+static void ldict_insert(ldict_t *d, ldict_entry_t e)
+{
+    int mask = d->cap - 1;
+    int idx = e.hash & mask;
+
+    for (int dist=0; ; dist++, idx = (idx + 1) & mask)
+    {
+        ldict_entry_t *slot = &d->entries[idx];
+        if (NULL == slot->key)
+        {
+            *slot = e;
+            d->count++;
+            return;
+        }
+
+        int slot_dist = ldict_dist(d, idx);
+        if (slot_dist < dist)
+        {
+            ldict_entry_t t = *slot; *slot = e; e = t;
+            dist = slot_dist;
+        }
+    }
+}
+
+/**
+ * 扩容并重新插入所有元素，负载因子保持在 7/8 以下。
+ */
+static void ldict_grow(ldict_t *d)
+{
+    int old_cap = d->cap;
+    ldict_entry_t *old = d->entries;
+
+    d->cap = old_cap? old_cap * 2: LDICT_CAP_MIN;
+    d->entries = calloc(d->cap, sizeof(ldict_entry_t));
+    d->count = 0;
+
+    for (int i=0; i < old_cap; i++)
+    {
+        if (old[i].key) { ldict_insert(d, old[i]); }
+    }
+    free(old);
+}
+
+
+lval_t *ldict_get(ldict_t *d, lval_t *k)
+{
+    int idx = ldict_find(d, k, lval_hash(k));
+    return idx < 0? NULL: d->entries[idx].val;
+}
+
+void ldict_put(ldict_t *d, lval_t *k, lval_t *v)
+{
+    unsigned long long hash = lval_hash(k);
+
+    int idx = ldict_find(d, k, hash);
+    if (idx >= 0)
+    {
+        lval_del(k);
+        lval_del(d->entries[idx].val);
+        d->entries[idx].val = v;
+        return;
+    }
+
+    if ((d->count + 1) * 8 > d->cap * 7) { ldict_grow(d); }
+
+    ldict_entry_t e = { hash, k, v };
+    ldict_insert(d, e);
+}
+
+/**
+ * 删除键值对，之后将探测链上的后续元素逐个前移（backward shift），无需墓碑标记。
+ */
+int ldict_remove(ldict_t *d, lval_t *k)
+{
+    int idx = ldict_find(d, k, lval_hash(k));
+    if (idx < 0) { return 0; }
+
+    lval_del(d->entries[idx].key);
+    lval_del(d->entries[idx].val);
+
+    int mask = d->cap - 1;
+    int next = (idx + 1) & mask;
+    while (d->entries[next].key && ldict_dist(d, next) > 0)
+    {
+        d->entries[idx] = d->entries[next];
+        idx = next;
+        next = (next + 1) & mask;
+    }
+
+    d->entries[idx].key = NULL;
+    d->entries[idx].val = NULL;
+    d->count--;
+    return 1;
+}
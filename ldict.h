@@ -0,0 +1,59 @@
+/*******
+ * Lispy Dictionary 哈希表模块。
+ *  提供 LVAL_DICT 使用的开放寻址（Robin Hood）哈希表，键支持数字、字符串和符号类型。
+ */
+#ifndef ldict_h
+#define ldict_h
+
+#include "lvalues.h"
+
+/* 头文件循环嵌套，前置声明。*/
+#ifndef predefinition
+#define predefinition
+struct lenv_s;
+typedef struct lenv_s lenv_t;
+struct lval_s;
+typedef struct lval_s lval_t;
+typedef lval_t *(*lbuiltin)(lenv_t*, lval_t*);  // 路由器函数指针类型 
+#endif
+
+/* 哈希表槽位，key 为 NULL 表示空槽。*/
+typedef struct
+{
+    unsigned long long hash; // 键的哈希值
+    struct lval_s *key;   // 键
+    struct lval_s *val;   // 值
+} ldict_entry_t;
+
+typedef struct ldict_s
+{
+    int refs;               // 引用计数，lval_copy 共享同一张表
+    int count;              // 键值对数目
+    int cap;                // 槽位数目，总是 2 的幂
+    ldict_entry_t *entries; // 槽位数组
+} ldict_t;
+
+
+/* 构造函数与析构函数，拷贝只增加引用计数。*/
+ldict_t *ldict_new(void);
+void ldict_del(ldict_t *d);
+ldict_t *ldict_copy(ldict_t *d);
+
+/* 写入前调用，表被共享时返回独占的深拷贝（写时复制）。*/
+ldict_t *ldict_unshare(ldict_t *d);
+
+/* 键类型检查与哈希函数 */
+int ldict_hashable(lval_t *k);
+unsigned long long lval_hash(lval_t *k);
+int ldict_key_eq(lval_t *x, lval_t *y);
+
+/* 查找接口，返回字典内部的值指针，不存在时返回 NULL。*/
+lval_t *ldict_get(ldict_t *d, lval_t *k);
+
+/* 插入或更新接口，字典接管 k 和 v 的所有权。d 必须是独占的。*/
+void ldict_put(ldict_t *d, lval_t *k, lval_t *v);
+
+/* 删除接口，键存在时返回 1，否则返回 0。d 必须是独占的。*/
+int ldict_remove(ldict_t *d, lval_t *k);
+
+#endif
@@ -58,7 +58,7 @@ lval_t *lenv_get(lenv_t *e, lval_t *v)
     }
     else
     {
-        return lval_err("Unbound symbol '%s'", v->sym);
+        return lval_errc(LERR_UNBOUND, "Unbound symbol '%s'", v->sym);
     }
 }
 
@@ -109,6 +109,9 @@ void lenv_def(lenv_t *e, lval_t *k, lval_t *v)
  */
 lval_t *lval_copy(lval_t *e_val)
 {
+    /* 错误载荷与 lval 在同一块内存中，单独拷贝。*/
+    if (LVAL_ERR == e_val->type) { return lval_err_copy(e_val); }
+
     lval_t *l_val = malloc(sizeof(lval_t));
 
     l_val->type = e_val->type;
@@ -130,18 +133,11 @@ lval_t *lval_copy(lval_t *e_val)
             
         case LVAL_NUM: l_val->num = e_val->num; break;
 
-        case LVAL_ERR:
-            l_val->err = malloc(strlen(e_val->err) + 1);
-            strcpy(l_val->err, e_val->err);
-            break;
         case LVAL_SYM:
             l_val->sym = malloc(strlen(e_val->sym) + 1);
             strcpy(l_val->sym, e_val->sym);
             break;
-        case LVAL_STR:
-            l_val->str = malloc(strlen(e_val->str) + 1);
-            strcpy(l_val->str, e_val->str);
-            break;
+        case LVAL_STR: lval_str_copy(l_val, e_val); break;
         
         case LVAL_SEXPR:
         case LVAL_QEXPR:
@@ -152,6 +148,10 @@ lval_t *lval_copy(lval_t *e_val)
                 l_val->cell[i] = lval_copy(e_val->cell[i]);  // 遍历所有子节点
             }
             break;
+
+        case LVAL_DICT: l_val->dict = ldict_copy(e_val->dict); break;
+        case LVAL_MAP: l_val->map = lmap_copy(e_val->map); break;
+        case LVAL_SB: lval_sb_copy(l_val, e_val); break;
     }
     return l_val;
 }
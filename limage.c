@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpc.h"
+
+#include "limage.h"
+
+
+/**
+ * 镜像格式。
+ *  文件头为 8 字节魔数，随后依次是格式版本、内置函数数目与内置函数签名，之后是全局环境。
+ *  镜像中不含任何指针，整数都以 LEB128 变长编码（有符号数先做 zigzag 变换），与加载地址无关。
+ *
+ *  环境：变量数目，随后每个变量依次为变量名与变量值。
+ *  值：  1 字节类型标记（enum ltypes），随后按类型：
+ *        数字     zigzag 变长整数
+ *        符号/字符串  长度 + 内容
+ *        S/Q-Expression  子节点数目 + 各子节点
+ *        函数     内置函数编号 + 1；为 0 时表示 Lambda，随后是其环境、形参与函数体
+ *        错误     错误码 + 渲染后的错误信息
+ *        字典/映射    键值对数目 + 各键值对
+ *        字符串构建器  片段数目 + 各片段
+ *
+ *  内置函数以其在 lenv_add_builtins 中注册的顺序编号，签名是所有内置函数名的 FNV-1a 哈希，
+ *  内置函数增删或调整顺序后旧镜像会被拒绝加载。
+ */
+#define LIMAGE_MAGIC     "LSPYIMG"
+#define LIMAGE_MAGIC_LEN 8
+
+/* 内置函数表，下标即镜像中的编号。*/
+static lenv_t *limage_builtins(unsigned long long *sig)
+{
+    lenv_t *b = lenv_init();
+    lenv_add_builtins(b);
+
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 0; i < b->count; i++)
+    {
+        for (const char *p = b->syms[i]; ; p++)
+        {
+            h ^= (unsigned char)*p;
+            h *= 1099511628211ULL;
+            if ('\0' == *p) { break; }
+        }
+    }
+    *sig = h;
+    return b;
+}
+
+static char *limage_error(const char *filename, const char *msg)
+{
+    size_t n = strlen(filename) + strlen(msg) + 16;
+    char *err = malloc(n);
+    snprintf(err, n, "%s: error: %s\n", filename, msg);
+    return err;
+}
+
+
+/* 写入 */
+typedef struct
+{
+    char   *buf;
+    size_t len;
+    size_t cap;
+    lenv_t *builtins;  // 内置函数表，为 NULL 时不能编码内置函数
+    int    failed;     // 遇到了不在内置函数表中的函数
+} limage_w_t;
+
+static void limage_put(limage_w_t *w, const void *p, size_t n)
+{
+    if (w->len + n > w->cap)
+    {
+        while (w->len + n > w->cap) { w->cap *= 2; }
+        w->buf = realloc(w->buf, w->cap);
+    }
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+}
+
+static void limage_put_uint(limage_w_t *w, unsigned long long x)
+{
+    unsigned char b[10];
+    int n = 0;
+    while (x >= 0x80)
+    {
+        b[n++] = (unsigned char)(x | 0x80);
+        x >>= 7;
+    }
+    b[n++] = (unsigned char)x;
+    limage_put(w, b, n);
+}
+
+static void limage_put_int(limage_w_t *w, long x)
+{
+    limage_put_uint(w, ((unsigned long long)x << 1) ^ (unsigned long long)(x < 0? -1LL: 0));
+}
+
+static void limage_put_str(limage_w_t *w, const char *s, size_t n)
+{
+    limage_put_uint(w, n);
+    limage_put(w, s, n);
+}
+
+static void limage_put_val(limage_w_t *w, lval_t *v);
+
+static void limage_put_env(limage_w_t *w, lenv_t *e)
+{
+    limage_put_uint(w, e->count);
+    for (int i = 0; i < e->count; i++)
+    {
+        limage_put_str(w, e->syms[i], strlen(e->syms[i]));
+        limage_put_val(w, e->vals[i]);
+    }
+}
+
+static void limage_put_pair(lval_t *k, lval_t *v, void *data)
+{
+    limage_put_val(data, k);
+    limage_put_val(data, v);
+}
+
+static void limage_put_val(limage_w_t *w, lval_t *v)
+{
+    unsigned char type = (unsigned char)v->type;
+    limage_put(w, &type, 1);
+
+    switch (v->type)
+    {
+        case LVAL_NUM: limage_put_int(w, v->num); break;
+        case LVAL_SYM: limage_put_str(w, v->sym, strlen(v->sym)); break;
+        case LVAL_STR: limage_put_str(w, v->str, v->len); break;
+
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            limage_put_uint(w, v->count);
+            for (int i = 0; i < v->count; i++) { limage_put_val(w, v->cell[i]); }
+            break;
+
+        case LVAL_FUN:
+            if (v->builtin)
+            {
+                int id = 0, num = w->builtins? w->builtins->count: 0;
+                while (id < num && w->builtins->vals[id]->builtin != v->builtin) { id++; }
+                if (id == num) { w->failed = 1; }
+                limage_put_uint(w, id + 1);
+            }
+            else
+            {
+                limage_put_uint(w, 0);
+                limage_put_env(w, v->env);
+                limage_put_val(w, v->formals);
+                limage_put_val(w, v->body);
+            }
+            break;
+
+        case LVAL_ERR:
+        {
+            char buf[LERR_MSG_MAX];
+            size_t n = lval_err_str(v, buf, sizeof(buf));
+            limage_put_uint(w, v->err->code);
+            limage_put_str(w, buf, n);
+            break;
+        }
+
+        case LVAL_DICT:
+            limage_put_uint(w, v->dict->count);
+            for (int i = 0; i < v->dict->cap; i++)
+            {
+                ldict_entry_t *x = &v->dict->entries[i];
+                if (x->key) { limage_put_pair(x->key, x->val, w); }
+            }
+            break;
+
+        case LVAL_MAP:
+            limage_put_uint(w, v->map->count);
+            lmap_foreach(v->map, limage_put_pair, w);
+            break;
+
+        case LVAL_SB:
+            limage_put_uint(w, v->sb_count);
+            for (int i = 0; i < v->sb_count; i++) { limage_put_val(w, v->sb->pieces[i]); }
+            break;
+    }
+}
+
+/**
+ * 写入镜像。
+ *  先在内存中完成编码，再一次性写入文件。
+ */
+int limage_dump(lenv_t *e, const char *filename, char **err)
+{
+    unsigned long long sig;
+    limage_w_t w;
+    w.cap = 4096;
+    w.len = 0;
+    w.buf = malloc(w.cap);
+    w.builtins = limage_builtins(&sig);
+    w.failed = 0;
+
+    limage_put(&w, LIMAGE_MAGIC, LIMAGE_MAGIC_LEN);
+    limage_put_uint(&w, LIMAGE_VERSION);
+    limage_put_uint(&w, w.builtins->count);
+    limage_put_uint(&w, sig);
+    limage_put_env(&w, e);
+    lenv_del(w.builtins);
+
+    int ok = 0;
+    if (w.failed)
+    {
+        *err = limage_error(filename, "Unknown builtin function!");
+    }
+    else
+    {
+        FILE *f = fopen(filename, "wb");
+        ok = f && fwrite(w.buf, 1, w.len, f) == w.len;
+        if (f && 0 != fclose(f)) { ok = 0; }
+        if (!ok) { *err = limage_error(filename, "Unable to write image!"); }
+    }
+
+    free(w.buf);
+    return ok;
+}
+
+
+/* 读取 */
+typedef struct
+{
+    const unsigned char *p;
+    const unsigned char *end;
+    lenv_t *builtins;  // 内置函数表，为 NULL 时不能解码内置函数
+    int    failed;     // 镜像被截断或内容不合法
+} limage_r_t;
+
+static unsigned long long limage_get_uint(limage_r_t *r)
+{
+    unsigned long long x = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (r->p == r->end) { break; }
+        unsigned char b = *r->p++;
+        x |= (unsigned long long)(b & 0x7f) << shift;
+        if (0 == (b & 0x80)) { return x; }
+    }
+    r->failed = 1;
+    return 0;
+}
+
+static long limage_get_int(limage_r_t *r)
+{
+    unsigned long long x = limage_get_uint(r);
+    return (long)((x >> 1) ^ (0 - (x & 1)));
+}
+
+/* 元素数目，每个元素至少占 1 字节，超过剩余长度时视为损坏，避免按错误的数目分配内存。*/
+static size_t limage_get_count(limage_r_t *r)
+{
+    unsigned long long n = limage_get_uint(r);
+    if (n > (unsigned long long)(r->end - r->p) || n > 0x7fffffff) { r->failed = 1; return 0; }
+    return (size_t)n;
+}
+
+/* 返回指向镜像内部的字符串，不以 '\0' 结尾。*/
+static const char *limage_get_str(limage_r_t *r, size_t *n)
+{
+    *n = limage_get_count(r);
+    if (r->failed) { return NULL; }
+
+    const char *s = (const char *)r->p;
+    r->p += *n;
+    return s;
+}
+
+static lval_t *limage_get_val(limage_r_t *r);
+
+static lenv_t *limage_get_env(limage_r_t *r)
+{
+    size_t n = limage_get_count(r);
+    if (r->failed) { return NULL; }
+
+    lenv_t *e = lenv_init();
+    e->syms = malloc(sizeof(char *) * n);
+    e->vals = malloc(sizeof(lval_t *) * n);
+
+    while ((size_t)e->count < n)
+    {
+        size_t len;
+        const char *s = limage_get_str(r, &len);
+        lval_t *v = s? limage_get_val(r): NULL;
+        if (NULL == v)
+        {
+            lenv_del(e);
+            return NULL;
+        }
+
+        e->syms[e->count] = malloc(len + 1);
+        memcpy(e->syms[e->count], s, len);
+        e->syms[e->count][len] = '\0';
+        e->vals[e->count++] = v;
+    }
+    return e;
+}
+
+/* 读取一个键值对，键不可哈希时视为损坏。*/
+static int limage_get_pair(limage_r_t *r, lval_t **k, lval_t **v)
+{
+    *k = limage_get_val(r);
+    *v = *k? limage_get_val(r): NULL;
+    if (*v && ldict_hashable(*k)) { return 1; }
+
+    if (*k) { lval_del(*k); }
+    if (*v) { lval_del(*v); }
+    r->failed = 1;
+    return 0;
+}
+
+static lval_t *limage_get_val(limage_r_t *r)
+{
+    if (r->p == r->end) { r->failed = 1; return NULL; }
+    int type = *r->p++;
+
+    switch (type)
+    {
+        case LVAL_NUM:
+        {
+            long x = limage_get_int(r);
+            return r->failed? NULL: lval_num(x);
+        }
+
+        case LVAL_SYM:
+        case LVAL_STR:
+        {
+            size_t n;
+            const char *s = limage_get_str(r, &n);
+            if (NULL == s) { return NULL; }
+            return LVAL_SYM == type? lval_sym_n(s, n): lval_str_n(s, n);
+        }
+
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+        {
+            size_t n = limage_get_count(r);
+            if (r->failed) { return NULL; }
+
+            lval_t *v = LVAL_SEXPR == type? lval_sexpr(): lval_qexpr();
+            v->cell = n? malloc(sizeof(lval_t *) * n): NULL;
+            while ((size_t)v->count < n)
+            {
+                lval_t *x = limage_get_val(r);
+                if (NULL == x)
+                {
+                    lval_del(v);
+                    return NULL;
+                }
+                v->cell[v->count++] = x;
+            }
+            return v;
+        }
+
+        case LVAL_FUN:
+        {
+            unsigned long long id = limage_get_uint(r);
+            if (r->failed) { return NULL; }
+            if (id > 0)
+            {
+                if (NULL == r->builtins || id > (unsigned long long)r->builtins->count)
+                {
+                    r->failed = 1;
+                    return NULL;
+                }
+                return lval_fun(r->builtins->vals[id - 1]->builtin);
+            }
+
+            lenv_t *env = limage_get_env(r);
+            lval_t *formals = env? limage_get_val(r): NULL;
+            lval_t *body = formals? limage_get_val(r): NULL;
+            if (NULL == body)
+            {
+                if (formals) { lval_del(formals); }
+                if (env) { lenv_del(env); }
+                return NULL;
+            }
+
+            /* 父环境在每次调用时才设置，镜像中不保存。*/
+            lval_t *v = malloc(sizeof(lval_t));
+            v->type = LVAL_FUN;
+            v->builtin = NULL;
+            v->env = env;
+            v->formals = formals;
+            v->body = body;
+            return v;
+        }
+
+        case LVAL_ERR:
+        {
+            int code = (int)limage_get_uint(r);
+            size_t n;
+            const char *s = limage_get_str(r, &n);
+            if (NULL == s || n >= LERR_MSG_MAX) { r->failed = 1; return NULL; }
+
+            char buf[LERR_MSG_MAX];
+            memcpy(buf, s, n);
+            buf[n] = '\0';
+            return lval_errc(code, "%s", buf);
+        }
+
+        case LVAL_DICT:
+        {
+            size_t n = limage_get_count(r);
+            if (r->failed) { return NULL; }
+
+            lval_t *v = lval_dict();
+            for (size_t i = 0; i < n; i++)
+            {
+                lval_t *k, *x;
+                if (!limage_get_pair(r, &k, &x))
+                {
+                    lval_del(v);
+                    return NULL;
+                }
+                ldict_put(v->dict, k, x);
+            }
+            return v;
+        }
+
+        case LVAL_MAP:
+        {
+            size_t n = limage_get_count(r);
+            if (r->failed) { return NULL; }
+
+            lval_t *v = lval_map();
+            lmap_transient_begin(v->map);
+            for (size_t i = 0; i < n; i++)
+            {
+                lval_t *k, *x;
+                if (!limage_get_pair(r, &k, &x))
+                {
+                    lmap_transient_end(v->map);
+                    lval_del(v);
+                    return NULL;
+                }
+                lmap_put(v->map, k, x);
+            }
+            lmap_transient_end(v->map);
+            return v;
+        }
+
+        case LVAL_SB:
+        {
+            size_t n = limage_get_count(r);
+            if (r->failed) { return NULL; }
+
+            lval_t *v = lval_sb();
+            for (size_t i = 0; i < n; i++)
+            {
+                lval_t *x = limage_get_val(r);
+                if (NULL == x || LVAL_STR != x->type)
+                {
+                    if (x) { lval_del(x); }
+                    lval_del(v);
+                    r->failed = 1;
+                    return NULL;
+                }
+                lval_sb_append(v, x);
+            }
+            return v;
+        }
+    }
+
+    r->failed = 1;
+    return NULL;
+}
+
+/**
+ * 读取镜像。
+ *  镜像文件通过 mmap 映射后直接在页缓存上解码，不复制文件内容。
+ */
+lenv_t *limage_load(const char *filename, char **err)
+{
+    size_t len;
+    char *buf = mpc_map_file(filename, &len);
+    if (NULL == buf)
+    {
+        *err = limage_error(filename, "Unable to open image!");
+        return NULL;
+    }
+
+    unsigned long long sig;
+    limage_r_t r;
+    r.p = (const unsigned char *)buf;
+    r.end = r.p + len;
+    r.builtins = limage_builtins(&sig);
+    r.failed = 0;
+
+    lenv_t *e = NULL;
+    if (len < LIMAGE_MAGIC_LEN || 0 != memcmp(buf, LIMAGE_MAGIC, LIMAGE_MAGIC_LEN))
+    {
+        *err = limage_error(filename, "Not a Lispy image!");
+    }
+    else
+    {
+        r.p += LIMAGE_MAGIC_LEN;
+        unsigned long long version = limage_get_uint(&r);
+        unsigned long long count = limage_get_uint(&r);
+        unsigned long long s = limage_get_uint(&r);
+
+        if (r.failed || LIMAGE_VERSION != version || (unsigned long long)r.builtins->count != count || sig != s)
+        {
+            *err = limage_error(filename, "Image was dumped by a different version of Lispy!");
+        }
+        else
+        {
+            e = limage_get_env(&r);
+            if (e && r.p != r.end)
+            {
+                lenv_del(e);
+                e = NULL;
+            }
+            if (NULL == e) { *err = limage_error(filename, "Image is corrupted!"); }
+        }
+    }
+
+    lenv_del(r.builtins);
+    mpc_unmap_file(buf, len);
+    return e;
+}
+
+/**
+ * 单个值的编码。
+ *  不使用内置函数表，值中含有内置函数时返回 NULL。
+ */
+char *limage_encode(lval_t *v, size_t *len)
+{
+    limage_w_t w;
+    w.cap = 4096;
+    w.len = 0;
+    w.buf = malloc(w.cap);
+    w.builtins = NULL;
+    w.failed = 0;
+
+    limage_put_val(&w, v);
+    if (w.failed)
+    {
+        free(w.buf);
+        return NULL;
+    }
+
+    *len = w.len;
+    return w.buf;
+}
+
+/* 单个值的解码，内容不合法时返回 NULL。*/
+lval_t *limage_decode(const char *buf, size_t len)
+{
+    limage_r_t r;
+    r.p = (const unsigned char *)buf;
+    r.end = r.p + len;
+    r.builtins = NULL;
+    r.failed = 0;
+
+    lval_t *v = limage_get_val(&r);
+    if (v && r.p != r.end)
+    {
+        lval_del(v);
+        v = NULL;
+    }
+    return v;
+}
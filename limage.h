@@ -0,0 +1,44 @@
+/*******
+ * Lispy Image 全局环境镜像模块。
+ *  将初始化完成的全局环境（内置函数、库中定义的变量与 Lambda 函数）序列化为紧凑的二进制镜像文件，
+ *  启动时映射镜像文件直接重建环境，不再重新读取和求值各个库文件。
+ */
+#ifndef limage_h
+#define limage_h
+
+#include "lvalues.h"
+
+
+/* 头文件循环嵌套，前置声明。*/
+#ifndef predefinition
+#define predefinition
+struct lenv_s;
+typedef struct lenv_s lenv_t;
+struct lval_s;
+typedef struct lval_s lval_t;
+typedef lval_t *(*lbuiltin)(lenv_t*, lval_t*);  // 路由器函数指针类型
+#endif
+
+
+#define LIMAGE_VERSION 1  // 镜像格式版本，格式变化时递增
+
+/**
+ * 写入镜像，--dump-image 命令行参数。
+ *  成功时返回 1；失败时返回 0，err 指向错误信息，由调用者释放。
+ */
+int limage_dump(lenv_t *e, const char *filename, char **err);
+
+/**
+ * 读取镜像，--image 命令行参数。
+ *  成功时返回重建的全局环境；失败时返回 NULL，err 指向错误信息，由调用者释放。
+ */
+lenv_t *limage_load(const char *filename, char **err);
+
+/**
+ * 单个值的编码与解码，格式与镜像中的值相同，供 load 的编译缓存使用。
+ *  不支持内置函数：编码遇到内置函数、解码遇到不合法的内容时返回 NULL。编码结果由调用者释放。
+ */
+char *limage_encode(lval_t *v, size_t *len);
+lval_t *limage_decode(const char *buf, size_t len);
+
+#endif
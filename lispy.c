@@ -1,15 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "mpc.h"
 
 #include "lvalues.h"
 #include "lenv.h"
 #include "lbuiltins.h"
+#include "lreader.h"
+#include "limage.h"
+#include "lcache.h"
 
 
 #ifdef _WIN32
-#include <string.h>
 
 static char buffer[2048];
 
@@ -52,6 +55,32 @@ mpc_parser_t* Lispy;
 
 int main(int argc, char *argv[])
 {
+    /* --mpc、--mpc-ast 参数：使用 mpc 语法解析源码，而不是手写的读取器。--packrat 参数：mpc 语法启用记忆化。
+     * --grammar-debug 参数：--mpc-ast 编译语法时打印每条规则的首字符集合以及生成的跳转表。
+     * --jobs=N 参数：load 大文件时的读取线程数目，默认为 CPU 核数，1 表示不并行。
+     * --max-depth=N 参数：源码中列表的最大嵌套层数，所有读取方式一致，默认为 0，表示不限制。
+     * --dump-image 参数：加载完所有源文件后将全局环境写入镜像文件并退出。--image 参数：从镜像文件恢复全局环境。
+     * --cache-dir=DIR 参数：load 的编译缓存目录，默认取 LISPY_CACHE_DIR 环境变量，为空时不使用缓存。*/
+    int nfiles = 0;
+    const char *image = NULL;
+    const char *dump_image = NULL;
+    int grammar_debug = 0;
+    lcache_dir = getenv("LISPY_CACHE_DIR");
+    for (int i=1; i < argc; i++)
+    {
+        if      (0 == strcmp(argv[i], "--mpc"))     { lread_mode = LREAD_MODE_MPC; }
+        else if (0 == strcmp(argv[i], "--mpc-ast")) { lread_mode = LREAD_MODE_MPC_AST; }
+        else if (0 == strcmp(argv[i], "--packrat")) { lread_packrat = 1; }
+        else if (0 == strcmp(argv[i], "--grammar-debug")) { grammar_debug = MPCA_LANG_DEBUG; }
+        else if (0 == strncmp(argv[i], "--jobs=", 7)) { lread_jobs = atoi(argv[i] + 7); }
+        else if (0 == strncmp(argv[i], "--max-depth=", 12)) { lread_max_depth = atoi(argv[i] + 12); }
+        else if (0 == strncmp(argv[i], "--cache-dir=", 12)) { lcache_dir = argv[i] + 12; }
+        else if (0 == strcmp(argv[i], "--image") && i + 1 < argc)      { image = argv[++i]; }
+        else if (0 == strcmp(argv[i], "--dump-image") && i + 1 < argc) { dump_image = argv[++i]; }
+        else { nfiles++; }
+    }
+    if (lcache_dir && '\0' == lcache_dir[0]) { lcache_dir = NULL; }
+
     Number   = mpc_new("number");
     Symbol   = mpc_new("symbol");
     String   = mpc_new("string");
@@ -61,56 +90,85 @@ int main(int argc, char *argv[])
     Expr     = mpc_new("expr");
     Lispy    = mpc_new("lispy");
 
-    mpca_lang(
-        MPCA_LANG_DEFAULT,
-        "                                                           \
-            number   : /-?[0-9]+/ ;                                 \
-            symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;           \
-            string   : /\"(\\\\.|[^\"])*\"/ ;                       \
-            comment  : /;[^\\r\\n]*/ ;                              \
-            sexpr    : '(' <expr>* ')' ;                            \
-            qexpr    : '{' <expr>* '}' ;                            \
-            expr     : <number>  | <symbol> | <string>              \
-                     | <comment> | <sexpr>  | <qexpr> ;             \
-            lispy    : /^/ <expr>* /$/ ;                            \
-        ",
-        Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy
-    );
-
-    lenv_t *e = lenv_init();
-    lenv_add_builtins(e);
-
-    if (1 == argc)
+    /* 只有 --mpc-ast 使用 mpca_lang 语法，其他读取方式不必在启动时编译语法。*/
+    if (LREAD_MODE_MPC_AST == lread_mode)
+    {
+        mpca_lang(
+            (lread_packrat? MPCA_LANG_PACKRAT: MPCA_LANG_DEFAULT) | grammar_debug,
+            "                                                           \
+                number   : /-?[0-9]+/ ;                                 \
+                symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;           \
+                string   : /\"(\\\\.|[^\"])*\"/ ;                       \
+                comment  : /;[^\\r\\n]*/ ;                              \
+                sexpr    : '(' <expr>* ')' ;                            \
+                qexpr    : '{' <expr>* '}' ;                            \
+                expr     : <number>  | <symbol> | <string>              \
+                         | <comment> | <sexpr>  | <qexpr> ;             \
+                lispy    : /^/ <expr>* /$/ ;                            \
+            ",
+            Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy
+        );
+    }
+
+    lenv_t *e = NULL;
+    int status = 0;
+    if (image)
+    {
+        char *err = NULL;
+        e = limage_load(image, &err);
+        if (NULL == e)
+        {
+            lval_t *x = lval_errc(LERR_LOAD, "Could not load image %s", err);
+            lval_println(x);
+            lval_print_flush();
+            lval_del(x);
+            free(err);
+            status = 1;
+            goto cleanup;
+        }
+    }
+    else
+    {
+        e = lenv_init();
+        lenv_add_builtins(e);
+    }
+
+    if (0 == nfiles && NULL == dump_image)
     {
         puts("Lispy Version 0.1");
         puts("Press Ctrl+c to Exit\n");
 
         while (1)
         {
+            lval_print_flush();
             char *input = readline("lispy> ");
             add_history(input);
 
-            mpc_result_t r;
-            if (mpc_parse("<stdin>", input, Lispy, &r))
+            char *err = NULL;
+            lval_t *v = lread("<stdin>", input, &err);
+            if (v)
             {
-                lval_t *x = lval_eval(e, lval_read(r.output));
+                lval_t *x = lval_eval(e, v);
                 lval_println(x);
                 lval_del(x);
-                mpc_ast_delete(r.output);
             }
             else
             {
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
+                lval_print_flush();
+                fputs(err, stdout);
+                free(err);
             }
             free(input);
         }
     }
 
-    if (argc >= 2)
+    if (nfiles > 0)
     {
         for (int i=1; i < argc; i++)
         {
+            if (0 == strcmp(argv[i], "--image") || 0 == strcmp(argv[i], "--dump-image")) { i++; continue; }
+            if (0 == strncmp(argv[i], "--", 2)) { continue; }
+
             /* Argument list with a single argument, the filename */
             lval_t *args = lval_add(lval_sexpr(), lval_str(argv[i]));
 
@@ -123,8 +181,26 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (dump_image)
+    {
+        char *err = NULL;
+        if (!limage_dump(e, dump_image, &err))
+        {
+            lval_t *x = lval_errc(LERR_LOAD, "Could not dump image %s", err);
+            lval_println(x);
+            lval_del(x);
+            free(err);
+            status = 1;
+        }
+    }
+
+    lval_print_flush();
     lenv_del(e);
-    
+
+cleanup:
+    if (lread_packrat) { lread_report(); }
+
+    lread_cleanup();
     mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-    return 0;
+    return status;
 }
\ No newline at end of file
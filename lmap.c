@@ -0,0 +1,503 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lmap.h"
+#include "ldict.h"
+
+#define LMAP_BITS      5    // 每层消耗的哈希位数
+#define LMAP_MASK      31   // 每层 32 个槽位
+#define LMAP_HASH_BITS 64   // 哈希位数耗尽后使用冲突节点
+
+/* 键值对叶子，通过引用计数在多个节点之间共享。*/
+typedef struct
+{
+    int refs;
+    unsigned long long hash;
+    lval_t *key;
+    lval_t *val;
+} lmap_leaf_t;
+
+/**
+ * 树节点。
+ *  datamap 和 nodemap 标记 32 个槽位中存放键值对和子节点的位置，
+ *  slots 按位图压缩存放：前面是键值对（按槽位编号排序），后面是子节点（按槽位编号排序）。
+ *  哈希冲突节点的两个位图均为 0，slots 中全部是哈希值相同的键值对。
+ */
+typedef struct lmap_node_s
+{
+    int refs;
+    unsigned long edit;     // 创建该节点的 transient 编辑标记
+    unsigned int datamap;
+    unsigned int nodemap;
+    int size;               // 已用槽位数目
+    int cap;                // 已分配槽位数目
+    void **slots;
+} lmap_node_t;
+
+static unsigned long lmap_edit_seq = 0;  // transient 编辑标记序号，不会重复使用
+
+
+static int lmap_popcount(unsigned int x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    return (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+static lmap_leaf_t *lmap_leaf_new(unsigned long long hash, lval_t *k, lval_t *v)
+{
+    lmap_leaf_t *l = malloc(sizeof(lmap_leaf_t));
+    l->refs = 1;
+    l->hash = hash;
+    l->key = k;
+    l->val = v;
+    return l;
+}
+
+static void lmap_leaf_unref(lmap_leaf_t *l)
+{
+    if (--l->refs > 0) { return; }
+    lval_del(l->key);
+    lval_del(l->val);
+    free(l);
+}
+
+static lmap_node_t *lmap_node_new(unsigned long edit, int cap)
+{
+    lmap_node_t *n = malloc(sizeof(lmap_node_t));
+    n->refs = 1;
+    n->edit = edit;
+    n->datamap = 0;
+    n->nodemap = 0;
+    n->size = 0;
+    n->cap = cap;
+    n->slots = malloc(sizeof(void *) * cap);
+    return n;
+}
+
+/* 节点中键值对的数目，其后的槽位均为子节点。*/
+static int lmap_node_leaves(lmap_node_t *n)
+{
+    return (n->datamap || n->nodemap)? lmap_popcount(n->datamap): n->size;
+}
+
+static void lmap_node_unref(lmap_node_t *n)
+{
+    if (--n->refs > 0) { return; }
+
+    int leaves = lmap_node_leaves(n);
+    for (int i=0; i < n->size; i++)
+    {
+        if (i < leaves) { lmap_leaf_unref(n->slots[i]); }
+        else            { lmap_node_unref(n->slots[i]); }
+    }
+    free(n->slots);
+    free(n);
+}
+
+/**
+ * 获取可修改的节点。
+ *  节点属于当前 transient 编辑时直接原地修改，否则复制节点并共享其所有子节点。
+ *  extra 为即将新增的槽位数目。
+ */
+static lmap_node_t *lmap_node_editable(lmap_node_t *n, unsigned long edit, int extra)
+{
+    if (edit && n->edit == edit)
+    {
+        if (n->size + extra > n->cap)
+        {
+            n->cap = (n->size + extra) * 2;
+            n->slots = realloc(n->slots, sizeof(void *) * n->cap);
+        }
+        return n;
+    }
+
+    lmap_node_t *m = lmap_node_new(edit, n->size + extra);
+    m->datamap = n->datamap;
+    m->nodemap = n->nodemap;
+    m->size = n->size;
+    memcpy(m->slots, n->slots, sizeof(void *) * n->size);
+
+    int leaves = lmap_node_leaves(n);
+    for (int i=0; i < n->size; i++)
+    {
+        if (i < leaves) { ((lmap_leaf_t *)n->slots[i])->refs++; }
+        else            { ((lmap_node_t *)n->slots[i])->refs++; }
+    }
+    return m;
+}
+
+static void lmap_slots_insert(lmap_node_t *n, int idx, void *x)
+{
+    memmove(&n->slots[idx+1], &n->slots[idx], sizeof(void *) * (n->size - idx));
+    n->slots[idx] = x;
+    n->size++;
+}
+
+static void lmap_slots_remove(lmap_node_t *n, int idx)
+{
+    memmove(&n->slots[idx], &n->slots[idx+1], sizeof(void *) * (n->size - idx - 1));
+    n->size--;
+}
+
+static int lmap_data_index(lmap_node_t *n, unsigned int bit)
+{
+    return lmap_popcount(n->datamap & (bit - 1));
+}
+
+static int lmap_node_index(lmap_node_t *n, unsigned int bit)
+{
+    return lmap_popcount(n->datamap) + lmap_popcount(n->nodemap & (bit - 1));
+}
+
+static unsigned int lmap_bit(unsigned long long hash, int shift)
+{
+    return 1u << ((hash >> shift) & LMAP_MASK);
+}
+
+/* 将两个落在同一槽位的键值对下沉到新的子节点中。*/
+static lmap_node_t *lmap_node_merge(lmap_leaf_t *a, lmap_leaf_t *b, int shift, unsigned long edit)
+{
+    lmap_node_t *n = lmap_node_new(edit, 2);
+
+    if (shift >= LMAP_HASH_BITS)
+    {
+        n->slots[0] = a;
+        n->slots[1] = b;
+        n->size = 2;
+        return n;
+    }
+
+    unsigned int ba = lmap_bit(a->hash, shift);
+    unsigned int bb = lmap_bit(b->hash, shift);
+
+    if (ba == bb)
+    {
+        n->nodemap = ba;
+        n->slots[0] = lmap_node_merge(a, b, shift + LMAP_BITS, edit);
+        n->size = 1;
+    }
+    else
+    {
+        n->datamap = ba | bb;
+        n->slots[0] = ba < bb? a: b;
+        n->slots[1] = ba < bb? b: a;
+        n->size = 2;
+    }
+    return n;
+}
+
+/**
+ * 插入或更新键值对。
+ *  n 由调用方持有；返回值为 n 本身（原地修改）或新节点，后者需由调用方替换 n。
+ */
+static lmap_node_t *lmap_node_assoc(lmap_node_t *n, unsigned long edit, int shift,
+                                    lmap_leaf_t *leaf, int *added)
+{
+    lmap_node_t *m;
+
+    if (shift >= LMAP_HASH_BITS)
+    {
+        for (int i=0; i < n->size; i++)
+        {
+            if (ldict_key_eq(((lmap_leaf_t *)n->slots[i])->key, leaf->key))
+            {
+                m = lmap_node_editable(n, edit, 0);
+                lmap_leaf_unref(m->slots[i]);
+                m->slots[i] = leaf;
+                return m;
+            }
+        }
+        m = lmap_node_editable(n, edit, 1);
+        m->slots[m->size++] = leaf;
+        *added = 1;
+        return m;
+    }
+
+    unsigned int bit = lmap_bit(leaf->hash, shift);
+
+    if (n->datamap & bit)
+    {
+        int idx = lmap_data_index(n, bit);
+        lmap_leaf_t *old = n->slots[idx];
+
+        m = lmap_node_editable(n, edit, 0);
+
+        if (old->hash == leaf->hash && ldict_key_eq(old->key, leaf->key))
+        {
+            lmap_leaf_unref(old);
+            m->slots[idx] = leaf;
+            return m;
+        }
+
+        /* 槽位中已有其他键，将两个键值对下沉到子节点 */
+        old->refs++;
+        lmap_node_t *sub = lmap_node_merge(old, leaf, shift + LMAP_BITS, edit);
+
+        lmap_leaf_unref(old);
+        lmap_slots_remove(m, idx);
+        m->datamap &= ~bit;
+        m->nodemap |= bit;
+        lmap_slots_insert(m, lmap_node_index(m, bit), sub);
+        *added = 1;
+        return m;
+    }
+
+    if (n->nodemap & bit)
+    {
+        int idx = lmap_node_index(n, bit);
+        lmap_node_t *child = n->slots[idx];
+        lmap_node_t *nc = lmap_node_assoc(child, edit, shift + LMAP_BITS, leaf, added);
+
+        if (nc == child) { return n; }  // 子节点已原地修改，说明 n 也属于当前编辑
+
+        m = lmap_node_editable(n, edit, 0);
+        lmap_node_unref(m->slots[idx]);
+        m->slots[idx] = nc;
+        return m;
+    }
+
+    m = lmap_node_editable(n, edit, 1);
+    lmap_slots_insert(m, lmap_data_index(m, bit), leaf);
+    m->datamap |= bit;
+    *added = 1;
+    return m;
+}
+
+/**
+ * 删除键值对。
+ *  键不存在时返回 n 本身且 removed 为 0；节点删空时返回 NULL，由调用方释放 n。
+ */
+static lmap_node_t *lmap_node_dissoc(lmap_node_t *n, unsigned long edit, int shift,
+                                     lval_t *k, unsigned long long hash, int *removed)
+{
+    lmap_node_t *m;
+
+    if (shift >= LMAP_HASH_BITS)
+    {
+        for (int i=0; i < n->size; i++)
+        {
+            if (ldict_key_eq(((lmap_leaf_t *)n->slots[i])->key, k))
+            {
+                *removed = 1;
+                if (1 == n->size) { return NULL; }
+
+                m = lmap_node_editable(n, edit, 0);
+                lmap_leaf_unref(m->slots[i]);
+                lmap_slots_remove(m, i);
+                return m;
+            }
+        }
+        return n;
+    }
+
+    unsigned int bit = lmap_bit(hash, shift);
+
+    if (n->datamap & bit)
+    {
+        int idx = lmap_data_index(n, bit);
+        lmap_leaf_t *leaf = n->slots[idx];
+        if (leaf->hash != hash || !ldict_key_eq(leaf->key, k)) { return n; }
+
+        *removed = 1;
+        if (1 == n->size) { return NULL; }
+
+        m = lmap_node_editable(n, edit, 0);
+        lmap_leaf_unref(m->slots[idx]);
+        lmap_slots_remove(m, idx);
+        m->datamap &= ~bit;
+        return m;
+    }
+
+    if (n->nodemap & bit)
+    {
+        int idx = lmap_node_index(n, bit);
+        lmap_node_t *child = n->slots[idx];
+        lmap_node_t *nc = lmap_node_dissoc(child, edit, shift + LMAP_BITS, k, hash, removed);
+
+        if (0 == *removed) { return n; }
+
+        if (NULL == nc)
+        {
+            if (1 == n->size) { return NULL; }
+
+            m = lmap_node_editable(n, edit, 0);
+            lmap_node_unref(m->slots[idx]);
+            lmap_slots_remove(m, idx);
+            m->nodemap &= ~bit;
+            return m;
+        }
+
+        /* 子节点只剩一个键值对时，将其上提到当前节点，保持树的紧凑 */
+        if (1 == nc->size && 0 == nc->nodemap)
+        {
+            lmap_leaf_t *leaf = nc->slots[0];
+            leaf->refs++;
+            if (nc != child) { lmap_node_unref(nc); }
+
+            m = lmap_node_editable(n, edit, 0);
+            lmap_node_unref(m->slots[idx]);
+            lmap_slots_remove(m, idx);
+            m->nodemap &= ~bit;
+            lmap_slots_insert(m, lmap_data_index(m, bit), leaf);
+            m->datamap |= bit;
+            return m;
+        }
+
+        if (nc == child) { return n; }
+
+        m = lmap_node_editable(n, edit, 0);
+        lmap_node_unref(m->slots[idx]);
+        m->slots[idx] = nc;
+        return m;
+    }
+
+    return n;
+}
+
+static void lmap_node_foreach(lmap_node_t *n, void (*f)(lval_t *, lval_t *, void *), void *data)
+{
+    int leaves = lmap_node_leaves(n);
+    for (int i=0; i < n->size; i++)
+    {
+        if (i < leaves)
+        {
+            lmap_leaf_t *leaf = n->slots[i];
+            f(leaf->key, leaf->val, data);
+        }
+        else
+        {
+            lmap_node_foreach(n->slots[i], f, data);
+        }
+    }
+}
+
+
+/**
+ * 构造函数。
+ */
+lmap_t *lmap_new(void)
+{
+    lmap_t *m = malloc(sizeof(lmap_t));
+    m->count = 0;
+    m->edit = 0;
+    m->root = NULL;
+    return m;
+}
+
+/**
+ * 析构函数，只释放不再被其他映射共享的节点。
+ */
+void lmap_del(lmap_t *m)
+{
+    if (m->root) { lmap_node_unref(m->root); }
+    free(m);
+}
+
+/**
+ * 拷贝函数，新旧映射共享整棵树。不能在 transient 模式中拷贝。
+ */
+lmap_t *lmap_copy(lmap_t *m)
+{
+    lmap_t *n = lmap_new();
+    n->count = m->count;
+    n->root = m->root;
+    if (n->root) { n->root->refs++; }
+    return n;
+}
+
+lval_t *lmap_get(lmap_t *m, lval_t *k)
+{
+    unsigned long long hash = lval_hash(k);
+    lmap_node_t *n = m->root;
+
+    for (int shift=0; n; shift += LMAP_BITS)
+    {
+        if (shift >= LMAP_HASH_BITS)
+        {
+            for (int i=0; i < n->size; i++)
+            {
+                lmap_leaf_t *leaf = n->slots[i];
+                if (ldict_key_eq(leaf->key, k)) { return leaf->val; }
+            }
+            return NULL;
+        }
+
+        unsigned int bit = lmap_bit(hash, shift);
+
+        if (n->datamap & bit)
+        {
+            lmap_leaf_t *leaf = n->slots[lmap_data_index(n, bit)];
+            return (leaf->hash == hash && ldict_key_eq(leaf->key, k))? leaf->val: NULL;
+        }
+        if (0 == (n->nodemap & bit)) { return NULL; }
+
+        n = n->slots[lmap_node_index(n, bit)];
+    }
+    return NULL;
+}
+
+/**
+ * 插入或更新。持久化模式下复制从根到目标的路径，其余节点与旧树共享。
+ */
+void lmap_put(lmap_t *m, lval_t *k, lval_t *v)
+{
+    lmap_leaf_t *leaf = lmap_leaf_new(lval_hash(k), k, v);
+
+    if (NULL == m->root)
+    {
+        m->root = lmap_node_new(m->edit, 1);
+        m->root->datamap = lmap_bit(leaf->hash, 0);
+        m->root->slots[0] = leaf;
+        m->root->size = 1;
+        m->count = 1;
+        return;
+    }
+
+    int added = 0;
+    lmap_node_t *root = lmap_node_assoc(m->root, m->edit, 0, leaf, &added);
+    if (root != m->root)
+    {
+        lmap_node_unref(m->root);
+        m->root = root;
+    }
+    m->count += added;
+}
+
+int lmap_remove(lmap_t *m, lval_t *k)
+{
+    if (NULL == m->root) { return 0; }
+
+    int removed = 0;
+    lmap_node_t *root = lmap_node_dissoc(m->root, m->edit, 0, k, lval_hash(k), &removed);
+    if (0 == removed) { return 0; }
+
+    if (root != m->root)
+    {
+        lmap_node_unref(m->root);
+        m->root = root;
+    }
+    m->count--;
+    return 1;
+}
+
+/**
+ * 开启 transient 模式。此后新建的节点带有本次的编辑标记，再次修改时无需复制。
+ */
+void lmap_transient_begin(lmap_t *m)
+{
+    m->edit = ++lmap_edit_seq;
+}
+
+/**
+ * 结束 transient 模式。编辑标记不再使用，树重新成为不可变的。
+ */
+void lmap_transient_end(lmap_t *m)
+{
+    m->edit = 0;
+}
+
+void lmap_foreach(lmap_t *m, void (*f)(lval_t *k, lval_t *v, void *data), void *data)
+{
+    if (m->root) { lmap_node_foreach(m->root, f, data); }
+}
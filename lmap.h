@@ -0,0 +1,53 @@
+/*******
+ * Lispy Map 持久化哈希映射模块。
+ *  提供 LVAL_MAP 使用的哈希数组映射字典树（HAMT）。所有节点不可变并通过引用计数共享，
+ *  更新操作只复制从根到目标位置的路径，其余节点在新旧映射之间共享。
+ *  批量构建时可开启 transient 模式，本次构建中新建的节点直接原地修改。
+ */
+#ifndef lmap_h
+#define lmap_h
+
+#include "lvalues.h"
+
+/* 头文件循环嵌套，前置声明。*/
+#ifndef predefinition
+#define predefinition
+struct lenv_s;
+typedef struct lenv_s lenv_t;
+struct lval_s;
+typedef struct lval_s lval_t;
+typedef lval_t *(*lbuiltin)(lenv_t*, lval_t*);  // 路由器函数指针类型 
+#endif
+
+struct lmap_node_s;
+
+typedef struct lmap_s
+{
+    int count;                  // 键值对数目
+    unsigned long edit;         // transient 模式的编辑标记，为 0 表示持久化模式
+    struct lmap_node_s *root;   // 根节点，空映射为 NULL
+} lmap_t;
+
+
+/* 构造函数与析构函数，拷贝只增加根节点的引用计数。*/
+lmap_t *lmap_new(void);
+void lmap_del(lmap_t *m);
+lmap_t *lmap_copy(lmap_t *m);
+
+/* 查找接口，返回映射内部的值指针，不存在时返回 NULL。*/
+lval_t *lmap_get(lmap_t *m, lval_t *k);
+
+/* 插入或更新接口，映射接管 k 和 v 的所有权。*/
+void lmap_put(lmap_t *m, lval_t *k, lval_t *v);
+
+/* 删除接口，键存在时返回 1，否则返回 0。*/
+int lmap_remove(lmap_t *m, lval_t *k);
+
+/* transient 批量构建模式 */
+void lmap_transient_begin(lmap_t *m);
+void lmap_transient_end(lmap_t *m);
+
+/* 遍历所有键值对 */
+void lmap_foreach(lmap_t *m, void (*f)(lval_t *k, lval_t *v, void *data), void *data);
+
+#endif
@@ -0,0 +1,1102 @@
+#ifndef _WIN32
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpc.h"
+
+#include "lreader.h"
+#include "lcache.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+extern mpc_parser_t* Number;
+extern mpc_parser_t* Symbol;
+extern mpc_parser_t* String;
+extern mpc_parser_t* Comment;
+extern mpc_parser_t* Sexpr;
+extern mpc_parser_t* Qexpr;
+extern mpc_parser_t* Expr;
+extern mpc_parser_t* Lispy;
+
+int lread_mode = LREAD_MODE_DIRECT;
+int lread_packrat = 0;
+int lread_max_depth = 0;
+
+
+/**
+ * 字符类别表。
+ *  空白字符与 mpc_whitespace 相同，符号字符与语法中 symbol 正则的字符集相同。
+ */
+#define LREAD_SPACE  0x01
+#define LREAD_DIGIT  0x02
+#define LREAD_SYMBOL 0x04
+
+#define LREAD_SYMBOL_CHARS \
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-*/\\=<>!&"
+
+static unsigned char lread_class[256];
+static int lread_class_ready = 0;
+
+static void lread_class_init(void)
+{
+    for (const char *c = " \f\n\r\t\v"; *c; c++)    { lread_class[(unsigned char)*c] |= LREAD_SPACE; }
+    for (const char *c = "0123456789"; *c; c++)      { lread_class[(unsigned char)*c] |= LREAD_DIGIT; }
+    for (const char *c = LREAD_SYMBOL_CHARS; *c; c++) { lread_class[(unsigned char)*c] |= LREAD_SYMBOL; }
+    lread_class_ready = 1;
+}
+
+#define LREAD_IS(c, cls) (lread_class[(unsigned char)(c)] & (cls))
+
+
+/**
+ * 期望信息，与 mpc 语法各部分失败时给出的描述一致。
+ */
+#define LREAD_EXP_DIGIT    "one of '0123456789'"
+#define LREAD_EXP_DIGITS   "one or more of one of '0123456789'"
+#define LREAD_EXP_SYMBOL   "one of '" LREAD_SYMBOL_CHARS "'"
+#define LREAD_EXP_SYMBOLS  "one or more of one of '" LREAD_SYMBOL_CHARS "'"
+#define LREAD_EXP_COMMENT  "none of '\r\n'"
+
+#define LREAD_EXPECT_MAX 16
+
+/* 最近一个词法单元的类型，用于判断出错位置紧邻的词法单元还期望哪些字符。*/
+enum lread_tokens
+{
+    LREAD_TOK_NONE,
+    LREAD_TOK_NUMBER,  // 数字，可继续接受数字
+    LREAD_TOK_MINUS,   // 单独的 '-' 符号，数字与符号两种解释都可继续
+    LREAD_TOK_SYMBOL,  // 符号，可继续接受符号字符
+    LREAD_TOK_COMMENT, // 注释，可继续接受非换行字符
+};
+
+/* 尚未读完的列表：子节点在暂存栈中的起点，以及列表的结束符。*/
+typedef struct
+{
+    int  base;
+    char close;
+} lread_open_t;
+
+typedef struct lread_s
+{
+    const char *filename;
+    const char *start;     // 输入起始位置
+    const char *end;       // 输入结束位置
+    const char *p;         // 当前读取位置
+
+    int        last;       // 最近一个词法单元的类型
+    const char *last_end;  // 最近一个词法单元的结束位置
+
+    lval_t     **stk;      // 子节点暂存栈，列表结束时一次性拷贝为 cell 数组
+    int        stk_num;
+    int        stk_cap;
+
+    lread_open_t *open;    // 尚未读完的列表，嵌套层数只受内存与 lread_max_depth 限制
+    int        open_num;
+    int        open_cap;
+
+    char       *err;       // 错误信息
+} lread_t;
+
+
+static int lread_ctz(unsigned int x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(x);
+#else
+    int n = 0;
+    while (0 == (x & 1)) { x >>= 1; n++; }
+    return n;
+#endif
+}
+
+/**
+ * 跳过空白字符。
+ *  单个空白字符最常见，先逐字节判断，较长的空白（缩进）每次用 SIMD 比较 16 个字节。
+ */
+static const char *lread_skip_space(const char *p, const char *end)
+{
+    if (p == end || !LREAD_IS(*p, LREAD_SPACE)) { return p; }
+    p++;
+
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab   = _mm_set1_epi8('\t');
+    const __m128i four  = _mm_set1_epi8(4);  // '\t' 到 '\r' 共 5 个连续的空白字符
+
+    while (end - p >= 16)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i *)p);
+        __m128i d = _mm_sub_epi8(b, tab);
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(b, space),
+                                  _mm_cmpeq_epi8(_mm_min_epu8(d, four), d));
+        unsigned int mask = ~_mm_movemask_epi8(ws) & 0xFFFF;
+        if (mask) { return p + lread_ctz(mask); }
+        p += 16;
+    }
+#endif
+
+    while (p < end && LREAD_IS(*p, LREAD_SPACE)) { p++; }
+    return p;
+}
+
+/**
+ * 查找 a 或 b 首次出现的位置，找不到时返回 end。用于跳过注释和字符串内容。
+ */
+static const char *lread_find2(const char *p, const char *end, char a, char b)
+{
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+
+    while (end - p >= 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)));
+        if (mask) { return p + lread_ctz(mask); }
+        p += 16;
+    }
+#endif
+
+    while (p < end && *p != a && *p != b) { p++; }
+    return p;
+}
+
+
+/**
+ * 错误信息格式化，与 mpc_err_string 的输出一致。
+ */
+static const char *lread_char_name(const lread_t *r, const char *at, char buf[4])
+{
+    if (at == r->end) { return "end of input"; }
+
+    switch (*at)
+    {
+        case '\a': return "bell";
+        case '\b': return "backspace";
+        case '\f': return "formfeed";
+        case '\r': return "carriage return";
+        case '\v': return "vertical tab";
+        case '\n': return "newline";
+        case '\t': return "tab";
+        case ' ' : return "space";
+        default:
+            buf[0] = '\''; buf[1] = *at; buf[2] = '\''; buf[3] = '\0';
+            return buf;
+    }
+}
+
+static char *lread_fail_msg(const char *filename, const char *msg)
+{
+    size_t n = strlen(filename) + strlen(msg) + 16;
+    char *err = malloc(n);
+    snprintf(err, n, "%s: error: %s\n", filename, msg);
+    return err;
+}
+
+static void lread_fail(lread_t *r, const char *msg)
+{
+    r->err = lread_fail_msg(r->filename, msg);
+}
+
+/* 行列号只在出错时才计算。*/
+static void lread_expected(lread_t *r, const char *at, const char **xs, int n)
+{
+    long row = 0;
+    const char *line = r->start;
+    for (const char *q = r->start; q < at; q++)
+    {
+        if ('\n' == *q) { row++; line = q + 1; }
+    }
+
+    char buf[4];
+    const char *received = lread_char_name(r, at, buf);
+
+    size_t len = strlen(r->filename) + strlen(received) + 64;
+    for (int i = 0; i < n; i++) { len += strlen(xs[i]) + 2; }
+
+    char *s = malloc(len);
+    int pos = snprintf(s, len, "%s:%li:%li: error: expected ", r->filename, row + 1, (long)(at - line) + 1);
+    for (int i = 0; i < n; i++)
+    {
+        const char *sep = (i == n - 1)? "": (i == n - 2)? " or ": ", ";
+        pos += snprintf(s + pos, len - pos, "%s%s", xs[i], sep);
+    }
+    snprintf(s + pos, len - pos, " at %s\n", received);
+    r->err = s;
+}
+
+static void lread_expect_add(const char **xs, int *n, const char *x)
+{
+    for (int i = 0; i < *n; i++)
+    {
+        if (0 == strcmp(xs[i], x)) { return; }
+    }
+    xs[(*n)++] = x;
+}
+
+/**
+ * 在 at 处既无法开始新的表达式，也不是当前列表的结束符。
+ *  期望信息依次为：紧邻的词法单元可以继续接受的字符，表达式的各个开始字符，当前列表的结束符。
+ */
+static void lread_expect_expr(lread_t *r, const char *at, char close)
+{
+    const char *xs[LREAD_EXPECT_MAX];
+    int n = 0;
+
+    if (r->last_end == at)
+    {
+        switch (r->last)
+        {
+            case LREAD_TOK_NUMBER: lread_expect_add(xs, &n, LREAD_EXP_DIGIT); break;
+            case LREAD_TOK_MINUS:
+                lread_expect_add(xs, &n, LREAD_EXP_DIGITS);
+                lread_expect_add(xs, &n, LREAD_EXP_SYMBOL);
+                break;
+            case LREAD_TOK_SYMBOL: lread_expect_add(xs, &n, LREAD_EXP_SYMBOL); break;
+            case LREAD_TOK_COMMENT: lread_expect_add(xs, &n, LREAD_EXP_COMMENT); break;
+        }
+    }
+
+    lread_expect_add(xs, &n, "'-'");
+    lread_expect_add(xs, &n, LREAD_EXP_DIGITS);
+    lread_expect_add(xs, &n, LREAD_EXP_SYMBOLS);
+    lread_expect_add(xs, &n, "'\"'");
+    lread_expect_add(xs, &n, "';'");
+    lread_expect_add(xs, &n, "'('");
+    lread_expect_add(xs, &n, "'{'");
+
+    if (')' == close) { lread_expect_add(xs, &n, "')'"); }
+    if ('}' == close) { lread_expect_add(xs, &n, "'}'"); }
+    if ('\0' == close)
+    {
+        lread_expect_add(xs, &n, "newline");
+        lread_expect_add(xs, &n, "end of input");
+    }
+
+    lread_expected(r, at, xs, n);
+}
+
+
+static void lread_push(lread_t *r, lval_t *v)
+{
+    if (r->stk_num == r->stk_cap)
+    {
+        r->stk_cap = r->stk_cap? r->stk_cap * 2: 64;
+        r->stk = realloc(r->stk, sizeof(lval_t *) * r->stk_cap);
+    }
+    r->stk[r->stk_num++] = v;
+}
+
+/* 将暂存栈中 base 之后的子节点移入列表 v。*/
+static lval_t *lread_pop_into(lread_t *r, lval_t *v, int base)
+{
+    v->count = r->stk_num - base;
+    if (v->count)
+    {
+        v->cell = malloc(sizeof(lval_t *) * v->count);
+        memcpy(v->cell, r->stk + base, sizeof(lval_t *) * v->count);
+    }
+    r->stk_num = base;
+    return v;
+}
+
+static void lread_token(lread_t *r, int type, const char *end)
+{
+    r->last = type;
+    r->last_end = end;
+    r->p = end;
+}
+
+/**
+ * 读取一个原子表达式，成功时把结果压入暂存栈（注释不产生结果）。列表由 lread_seq 处理。
+ */
+static int lread_expr(lread_t *r, char close)
+{
+    const char *p = r->p;
+    const char *end = r->end;
+    char c = *p;
+
+    /* 数字：-?[0-9]+，与语法中 number 优先于 symbol 的匹配顺序一致。*/
+    if (LREAD_IS(c, LREAD_DIGIT) || ('-' == c && p + 1 < end && LREAD_IS(p[1], LREAD_DIGIT)))
+    {
+        const char *q = p + 1;
+        while (q < end && LREAD_IS(*q, LREAD_DIGIT)) { q++; }
+        lread_push(r, lval_read_num(p));
+        lread_token(r, LREAD_TOK_NUMBER, q);
+        return 1;
+    }
+
+    if (LREAD_IS(c, LREAD_SYMBOL))
+    {
+        const char *q = p + 1;
+        while (q < end && LREAD_IS(*q, LREAD_SYMBOL)) { q++; }
+        lread_push(r, lval_sym_n(p, q - p));
+        lread_token(r, ('-' == c && q == p + 1)? LREAD_TOK_MINUS: LREAD_TOK_SYMBOL, q);
+        return 1;
+    }
+
+    /**
+     * 字符串："(\\.|[^"])*"。
+     *  反斜杠后跟换行或位于输入末尾时不构成转义，按普通字符处理。
+     */
+    if ('"' == c)
+    {
+        const char *q = p + 1;
+        const char *lone = NULL;  // 末尾单独的反斜杠
+        while (1)
+        {
+            q = lread_find2(q, end, '"', '\\');
+            if (q == end || '"' == *q) { break; }
+            if (q + 1 < end && '\n' != q[1]) { q += 2; continue; }
+            lone = ++q;
+        }
+
+        if (q == end)
+        {
+            const char *xs[LREAD_EXPECT_MAX];
+            int n = 0;
+            if (lone == end) { xs[n++] = "any character except a newline"; }
+            xs[n++] = "'\\'";
+            xs[n++] = "none of '\"'";
+            xs[n++] = "'\"'";
+            lread_expected(r, end, xs, n);
+            return 0;
+        }
+
+        lread_push(r, lval_read_str(p + 1, q - p - 1));
+        lread_token(r, LREAD_TOK_NONE, q + 1);
+        return 1;
+    }
+
+    if (';' == c)
+    {
+        lread_token(r, LREAD_TOK_COMMENT, lread_find2(p + 1, end, '\n', '\r'));
+        return 1;
+    }
+
+    lread_expect_expr(r, p, close);
+    return 0;
+}
+
+/* 开始读取一个列表，返回其结束符。*/
+static char lread_open(lread_t *r, char c)
+{
+    if (r->open_num == r->open_cap)
+    {
+        r->open_cap = r->open_cap? r->open_cap * 2: 16;
+        r->open = realloc(r->open, sizeof(lread_open_t) * r->open_cap);
+    }
+
+    lread_open_t *o = &r->open[r->open_num++];
+    o->base = r->stk_num;
+    o->close = ('(' == c)? ')': '}';
+
+    lread_token(r, LREAD_TOK_NONE, r->p + 1);
+    return o->close;
+}
+
+/* 列表读完，子节点移入列表后作为一个表达式压入暂存栈，返回外层列表的结束符。*/
+static char lread_close(lread_t *r)
+{
+    lread_open_t *o = &r->open[--r->open_num];
+
+    lread_token(r, LREAD_TOK_NONE, r->p + 1);
+    lread_push(r, lread_pop_into(r, (')' == o->close)? lval_sexpr(): lval_qexpr(), o->base));
+    return r->open_num? r->open[r->open_num - 1].close: '\0';
+}
+
+/**
+ * 读取顶层表达式序列直到输入末尾，成功时 r->p 停在输入末尾。
+ *  嵌套的列表记录在 r->open 中而不是递归读取，close 为当前列表的结束符，顶层为 '\0'。
+ */
+static int lread_seq(lread_t *r)
+{
+    char close = '\0';
+
+    while (1)
+    {
+        r->p = lread_skip_space(r->p, r->end);
+
+        if (r->p == r->end)
+        {
+            if (0 == r->open_num) { return 1; }
+        }
+        else if (*r->p == close)
+        {
+            if (0 == r->open_num) { return 1; }
+            close = lread_close(r);
+            continue;
+        }
+
+        if (r->p == r->end)
+        {
+            lread_expect_expr(r, r->p, close);
+            return 0;
+        }
+
+        if ('(' == *r->p || '{' == *r->p)
+        {
+            if (lread_max_depth > 0 && r->open_num >= lread_max_depth)
+            {
+                lread_fail(r, "Maximum recursion depth exceeded!");
+                return 0;
+            }
+            close = lread_open(r, *r->p);
+            continue;
+        }
+
+        if (!lread_expr(r, close)) { return 0; }
+    }
+}
+
+
+/**
+ * mpc 回退路径。
+ *  语法与 lispy.c 中 mpca_lang 定义的相同，但每条规则匹配时由 mpc_apply 或 fold 回调直接构造 lval，
+ *  不生成 mpc_ast_t，也就没有 tag 字符串拼接和对 AST 的第二次遍历。
+ */
+static mpc_parser_t *lread_parsers[8];
+static mpc_parser_t *lread_grammar = NULL;
+
+static void lreadf_del(mpc_val_t *x)
+{
+    if (x) { lval_del(x); }
+}
+
+/* packrat 记忆化的结果拷贝，注释的结果为 NULL。*/
+static mpc_val_t *lreadf_copy(mpc_val_t *x)
+{
+    return x? lval_copy(x): NULL;
+}
+
+static mpc_val_t *lreadf_number(mpc_val_t *x)
+{
+    lval_t *v = lval_read_num(x);
+    free(x);
+    return v;
+}
+
+/* 直接接管匹配到的字符串作为符号名。*/
+static mpc_val_t *lreadf_symbol(mpc_val_t *x)
+{
+    lval_t *v = malloc(sizeof(lval_t));
+    v->type = LVAL_SYM;
+    v->sym = x;
+    return v;
+}
+
+static mpc_val_t *lreadf_string(mpc_val_t *x)
+{
+    lval_t *v = lval_read_str((char *)x + 1, strlen(x) - 2);
+    free(x);
+    return v;
+}
+
+static mpc_val_t *lreadf_comment(mpc_val_t *x)
+{
+    free(x);
+    return NULL;
+}
+
+/* <expr>* 的结果折叠为 S-Expression，注释的结果为 NULL，直接跳过。*/
+static mpc_val_t *lreadf_seq(int n, mpc_val_t **xs)
+{
+    lval_t *v = lval_sexpr();
+    v->cell = n? malloc(sizeof(lval_t *) * n): NULL;
+    for (int i = 0; i < n; i++)
+    {
+        if (xs[i]) { v->cell[v->count++] = xs[i]; }
+    }
+    return v;
+}
+
+static mpc_val_t *lreadf_sexpr(int n, mpc_val_t **xs)
+{
+    (void)n;
+    free(xs[0]);
+    free(xs[2]);
+    return xs[1];
+}
+
+static mpc_val_t *lreadf_qexpr(int n, mpc_val_t **xs)
+{
+    lval_t *v = lreadf_sexpr(n, xs);
+    v->type = LVAL_QEXPR;
+    return v;
+}
+
+/**
+ * 与 mpca_lang 为每个语法元素生成的 and(state, apply_to(apply(x))) 包装同形。
+ *  这里用不分配内存的 pass 代替 state，使每层的递归深度以及超出深度上限时的报错与 mpca_lang 语法一致。
+ */
+static mpc_val_t *lreadf_pass(mpc_val_t *x, void *d)
+{
+    (void)d;
+    return x;
+}
+
+static mpc_parser_t *lread_wrap(mpc_parser_t *x, mpc_apply_t f)
+{
+    return mpc_and(2, mpcf_snd, mpc_pass(), mpc_apply_to(mpc_apply(x, f), lreadf_pass, NULL), mpcf_dtor_null);
+}
+
+static mpc_val_t *lreadf_id(mpc_val_t *x)
+{
+    return x;
+}
+
+static mpc_parser_t *lread_list(mpc_fold_t f, char open, char close, mpc_parser_t *Expr)
+{
+    return mpc_and(3, f,
+                   lread_wrap(mpc_tok(mpc_char(open)), lreadf_id),
+                   mpc_many(lreadf_seq, lread_wrap(Expr, lreadf_id)),
+                   lread_wrap(mpc_tok(mpc_char(close)), lreadf_id),
+                   free, lreadf_del);
+}
+
+static const char *lread_names[8] = { "number", "symbol", "string", "comment", "sexpr", "qexpr", "expr", "lispy" };
+
+static mpc_parser_t *lread_grammar_init(void)
+{
+    mpc_parser_t *Number  = mpc_new(lread_names[0]);
+    mpc_parser_t *Symbol  = mpc_new(lread_names[1]);
+    mpc_parser_t *String  = mpc_new(lread_names[2]);
+    mpc_parser_t *Comment = mpc_new(lread_names[3]);
+    mpc_parser_t *Sexpr   = mpc_new(lread_names[4]);
+    mpc_parser_t *Qexpr   = mpc_new(lread_names[5]);
+    mpc_parser_t *Expr    = mpc_new(lread_names[6]);
+    mpc_parser_t *Top     = mpc_new(lread_names[7]);
+
+    mpc_define(Number,  lread_wrap(mpc_tok(mpc_re("-?[0-9]+")), lreadf_number));
+    mpc_define(Symbol,  lread_wrap(mpc_tok(mpc_re("[a-zA-Z0-9_+\\-*/\\\\=<>!&]+")), lreadf_symbol));
+    mpc_define(String,  lread_wrap(mpc_tok(mpc_re("\"(\\\\.|[^\"])*\"")), lreadf_string));
+    mpc_define(Comment, lread_wrap(mpc_tok(mpc_re(";[^\\r\\n]*")), lreadf_comment));
+    mpc_define(Sexpr,   lread_list(lreadf_sexpr, '(', ')', Expr));
+    mpc_define(Qexpr,   lread_list(lreadf_qexpr, '{', '}', Expr));
+    mpc_define(Expr,    mpc_or(6, lread_wrap(Number, lreadf_id), lread_wrap(Symbol, lreadf_id),
+                                  lread_wrap(String, lreadf_id), lread_wrap(Comment, lreadf_id),
+                                  lread_wrap(Sexpr, lreadf_id),  lread_wrap(Qexpr, lreadf_id)));
+    mpc_define(Top,     mpc_and(3, lreadf_sexpr,
+                                lread_wrap(mpc_tok(mpc_re("^")), lreadf_id),
+                                mpc_many(lreadf_seq, lread_wrap(Expr, lreadf_id)),
+                                lread_wrap(mpc_tok(mpc_re("$")), lreadf_id),
+                                free, lreadf_del));
+
+    mpc_parser_t *ps[8] = { Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Top };
+    memcpy(lread_parsers, ps, sizeof(ps));
+
+    if (lread_packrat)
+    {
+        for (int i = 0; i < 8; i++) { mpc_memoize(ps[i], lreadf_copy, lreadf_del); }
+    }
+    return Top;
+}
+
+/**
+ * 输出各条语法规则的记忆化查询与命中次数。
+ *  手写读取器不经过 mpc，没有统计信息。
+ */
+void lread_report(void)
+{
+    mpc_parser_t *ast[8] = { Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy };
+    mpc_parser_t **ps = LREAD_MODE_MPC == lread_mode? lread_parsers: ast;
+
+    if (LREAD_MODE_DIRECT == lread_mode || NULL == ps[0]) { return; }
+
+    for (int i = 0; i < 8; i++)
+    {
+        mpc_memo_stats_t s;
+        mpc_memo_stats(ps[i], &s);
+        fprintf(stderr, "packrat %-8s lookups %ld, hits %ld, stores %ld\n",
+                lread_names[i], s.lookups, s.hits, s.stores);
+    }
+}
+
+void lread_cleanup(void)
+{
+    if (lread_grammar)
+    {
+        mpc_cleanup(8, lread_parsers[0], lread_parsers[1], lread_parsers[2], lread_parsers[3],
+                       lread_parsers[4], lread_parsers[5], lread_parsers[6], lread_parsers[7]);
+        lread_grammar = NULL;
+    }
+}
+
+/* lread_too_deep 遍历栈中的列表及其嵌套层数。*/
+typedef struct
+{
+    lval_t *v;
+    int    depth;
+} lread_level_t;
+
+/**
+ * 读取结果中列表的嵌套层数是否超过 max，顶层 S-Expression 本身不计。
+ *  结果可能嵌套很深，用显式栈遍历。
+ */
+static int lread_too_deep(lval_t *v, int max)
+{
+    int num = 0, cap = 64, deep = 0;
+    lread_level_t *stk = malloc(sizeof(lread_level_t) * cap);
+    stk[num++] = (lread_level_t){ v, 0 };
+
+    while (num > 0 && !deep)
+    {
+        lread_level_t it = stk[--num];
+        for (int i = 0; i < it.v->count; i++)
+        {
+            lval_t *c = it.v->cell[i];
+            if (LVAL_SEXPR != c->type && LVAL_QEXPR != c->type) { continue; }
+            if (it.depth + 1 > max) { deep = 1; break; }
+
+            if (num == cap)
+            {
+                cap *= 2;
+                stk = realloc(stk, sizeof(lread_level_t) * cap);
+            }
+            stk[num++] = (lread_level_t){ c, it.depth + 1 };
+        }
+    }
+
+    free(stk);
+    return deep;
+}
+
+/* 嵌套层数超过 lread_max_depth 时释放 v，返回与手写读取器相同的错误。*/
+static lval_t *lread_check_depth(const char *filename, lval_t *v, char **err)
+{
+    if (lread_max_depth > 0 && lread_too_deep(v, lread_max_depth))
+    {
+        lval_del(v);
+        *err = lread_fail_msg(filename, "Maximum recursion depth exceeded!");
+        return NULL;
+    }
+    return v;
+}
+
+/* mpc 解析结果转换为 lval，AST 方式下由 lval_read 遍历 AST。*/
+static lval_t *lread_mpc(const char *filename, mpc_result_t *res, int ok, char **err)
+{
+    if (!ok)
+    {
+        *err = mpc_err_string(res->error);
+        mpc_err_delete(res->error);
+        return NULL;
+    }
+
+    lval_t *v = res->output;
+    if (LREAD_MODE_MPC_AST == lread_mode)
+    {
+        v = lval_read(res->output);
+        mpc_ast_delete(res->output);
+    }
+
+    /* mpc 的递归深度上限留有余量，嵌套层数在这里精确检查，与手写读取器一致。*/
+    return lread_check_depth(filename, v, err);
+}
+
+/**
+ * mpc 每读入一层列表约需 LREAD_MPC_LEVEL 层递归，另有 LREAD_MPC_BASE 层固定开销（两种 mpc 读取方式的实测值）。
+ *  按 lread_max_depth 多留一层设置 mpc 的递归深度上限，未超过层数的输入不会因递归深度读取失败。
+ */
+#define LREAD_MPC_LEVEL 9
+#define LREAD_MPC_BASE  20
+
+static int lread_mpc_depth = -1;  // 已设置的 mpc 递归深度上限，-1 表示尚未设置
+
+static mpc_parser_t *lread_mpc_parser(void)
+{
+    mpc_parser_t *p = Lispy;
+    if (LREAD_MODE_MPC == lread_mode)
+    {
+        if (NULL == lread_grammar)
+        {
+            /* 语法中的正则表达式在编译时同样受 mpc 递归深度上限约束。*/
+            int old = mpc_set_max_depth(0);
+            lread_grammar = lread_grammar_init();
+            mpc_set_max_depth(old);
+        }
+        p = lread_grammar;
+    }
+
+    int depth = 0;
+    if (lread_max_depth > 0 && lread_max_depth < (INT_MAX - LREAD_MPC_BASE) / LREAD_MPC_LEVEL - 1)
+    {
+        depth = LREAD_MPC_LEVEL * (lread_max_depth + 1) + LREAD_MPC_BASE;
+    }
+    if (depth != lread_mpc_depth)
+    {
+        mpc_set_max_depth(depth);
+        lread_mpc_depth = depth;
+    }
+    return p;
+}
+
+/* 手写读取器读取 [input, end) 区间内的输入。*/
+static lval_t *lread_direct(const char *filename, const char *input, const char *end, char **err)
+{
+    lread_t r;
+    r.filename = filename;
+    r.start = r.p = input;
+    r.end = end;
+    r.last = LREAD_TOK_NONE;
+    r.last_end = NULL;
+    r.stk = NULL;
+    r.stk_num = r.stk_cap = 0;
+    r.open = NULL;
+    r.open_num = r.open_cap = 0;
+    r.err = NULL;
+
+    lval_t *v = NULL;
+    if (lread_seq(&r))
+    {
+        v = lread_pop_into(&r, lval_sexpr(), 0);
+    }
+    else
+    {
+        for (int i = 0; i < r.stk_num; i++) { lval_del(r.stk[i]); }
+        *err = r.err;
+    }
+
+    free(r.stk);
+    free(r.open);
+    return v;
+}
+
+/**
+ * 读取以 '\0' 结尾的输入，mpc 方式下同样直接在 input 上读取，不复制输入。
+ */
+lval_t *lread(const char *filename, const char *input, char **err)
+{
+    if (LREAD_MODE_DIRECT != lread_mode)
+    {
+        mpc_result_t res;
+        return lread_mpc(filename, &res, mpc_parse_borrowed(filename, input, lread_mpc_parser(), &res), err);
+    }
+
+    if (!lread_class_ready) { lread_class_init(); }
+
+    return lread_direct(filename, input, input + strlen(input), err);
+}
+
+/**
+ * 并行读取。
+ *  大文件先预扫描出顶层表达式之间的切分点，各块由多个线程分别读取后按原顺序拼接成一个 S-Expression，
+ *  builtin_load 仍按源码顺序求值。切分点都在顶层的换行符之后，各块都读取成功时拼接结果与整体读取相同；
+ *  任何一块失败时丢弃所有结果，由调用者整体重新顺序读取，错误信息与行列号保持不变。
+ *  packrat 的命中统计不是线程安全的，启用 --packrat 时不并行。
+ */
+#define LREAD_PAR_MIN   (256 * 1024)  // 启用并行读取的最小输入长度
+#define LREAD_CHUNK_MIN (64 * 1024)   // 每块的最小长度
+#define LREAD_JOBS_MAX  64            // 读取线程数目上限
+
+int lread_jobs = 0;
+
+/* 实际使用的读取线程数目，为 1 时不并行。*/
+static int lread_par_jobs(void)
+{
+#ifndef _WIN32
+    if (lread_packrat) { return 1; }
+
+    long n = lread_jobs > 0? lread_jobs: sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1? 1: n > LREAD_JOBS_MAX? LREAD_JOBS_MAX: (int)n;
+#else
+    return 1;
+#endif
+}
+
+#ifndef _WIN32
+
+typedef struct
+{
+    const char *filename;
+    const char **cuts;    // 切分点，第 i 块为 [cuts[i], cuts[i + 1])
+    lval_t     **vs;      // 各块的读取结果，失败时为 NULL
+    int        num;       // 块数目
+    int        next;      // 下一个待读取的块
+    int        failed;    // 已有块读取失败，其余线程不再领取新块
+    pthread_mutex_t lock;
+} lread_par_t;
+
+/**
+ * 预扫描切分点。
+ *  跟踪括号深度、字符串与注释，只在深度为 0 且不在字符串或注释中的换行符之后切分，每块不少于 min 个字节。
+ *  括号不匹配时切分点可能不在真正的顶层，但这样的输入整体读取必然失败，对应的块也会失败。
+ */
+static int lread_par_split(const char *p, const char *end, size_t min, const char **cuts, int max)
+{
+    int n = 0, depth = 0;
+    cuts[n++] = p;
+
+    while (p < end && n < max)
+    {
+        char c = *p++;
+        switch (c)
+        {
+            case '"':
+                for (;;)
+                {
+                    p = lread_find2(p, end, '"', '\\');
+                    if (p == end) { break; }
+                    if ('"' == *p++) { break; }
+                    if (p < end && '\n' != *p) { p++; }  // 与读取器一致，反斜杠后的换行不是转义
+                }
+                break;
+            case ';':
+                p = lread_find2(p, end, '\n', '\r');
+                break;
+            case '(': case '{':
+                depth++;
+                break;
+            case ')': case '}':
+                depth--;
+                break;
+            case '\n':
+                if (0 == depth && (size_t)(p - cuts[n - 1]) >= min && (size_t)(end - p) >= min)
+                {
+                    cuts[n++] = p;
+                }
+                break;
+        }
+    }
+
+    cuts[n] = end;
+    return n;
+}
+
+/* 读取一块，mpc 方式下块末尾已由 lread_par_seal 改为 '\0'。*/
+static lval_t *lread_par_chunk(const char *filename, const char *start, const char *end)
+{
+    char *err = NULL;
+    lval_t *v;
+
+    if (LREAD_MODE_DIRECT == lread_mode)
+    {
+        v = lread_direct(filename, start, end, &err);
+    }
+    else
+    {
+        mpc_result_t res;
+        v = lread_mpc(filename, &res, mpc_parse_borrowed(filename, start, lread_mpc_parser(), &res), &err);
+    }
+
+    free(err);
+    return v;
+}
+
+static void *lread_par_worker(void *arg)
+{
+    lread_par_t *par = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&par->lock);
+        int i = par->failed? par->num: par->next++;
+        pthread_mutex_unlock(&par->lock);
+
+        if (i >= par->num) { return NULL; }
+
+        par->vs[i] = lread_par_chunk(par->filename, par->cuts[i], par->cuts[i + 1]);
+        if (NULL == par->vs[i])
+        {
+            pthread_mutex_lock(&par->lock);
+            par->failed = 1;
+            pthread_mutex_unlock(&par->lock);
+        }
+    }
+}
+
+/**
+ * mpc 以 '\0' 判断输入结束：on 为 1 时把除最后一块外各块末尾的换行符改为 '\0'，各块直接在映射上读取，
+ *  on 为 0 时恢复换行符。输入是 mpc_map_file 的只读私有映射，写入前允许所在的页面写入，
+ *  写入只复制这些页面，不会修改文件。无法写入时恢复已修改的部分并返回 0。
+ */
+static int lread_par_seal(const char **cuts, int num, int on)
+{
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+
+    for (int i = 1; i < num; i++)
+    {
+        char *p = (char *)cuts[i] - 1;
+        if (on && 0 != mprotect((void *)((uintptr_t)p & ~(page - 1)), 1, PROT_READ | PROT_WRITE))
+        {
+            lread_par_seal(cuts, i, 0);
+            return 0;
+        }
+        *p = on? '\0': '\n';
+    }
+    return 1;
+}
+
+/* 并行读取 [input, input + len)，不满足并行条件或读取失败时返回 NULL。*/
+static lval_t *lread_par(const char *filename, const char *input, size_t len)
+{
+    int jobs = lread_par_jobs();
+    if (jobs < 2 || len < LREAD_PAR_MIN) { return NULL; }
+
+    size_t min = len / ((size_t)jobs * 4);
+    if (min < LREAD_CHUNK_MIN) { min = LREAD_CHUNK_MIN; }
+
+    int max = (int)(len / min) + 1;
+    const char **cuts = malloc(sizeof(char *) * (max + 1));
+    int num = lread_par_split(input, input + len, min, cuts, max);
+    if (num < 2)
+    {
+        free(cuts);
+        return NULL;
+    }
+
+    /* 线程启动前完成所有延迟初始化：字符类别表与 mpc 语法。*/
+    if (!lread_class_ready) { lread_class_init(); }
+    if (LREAD_MODE_DIRECT != lread_mode)
+    {
+        lread_mpc_parser();
+        if (!lread_par_seal(cuts, num, 1))
+        {
+            free(cuts);
+            return NULL;
+        }
+    }
+
+    lread_par_t par;
+    par.filename = filename;
+    par.cuts = cuts;
+    par.vs = calloc(num, sizeof(lval_t *));
+    par.num = num;
+    par.next = 0;
+    par.failed = 0;
+    pthread_mutex_init(&par.lock, NULL);
+
+    if (jobs > num) { jobs = num; }
+    pthread_t threads[LREAD_JOBS_MAX];
+    int started = 0;
+    while (started < jobs - 1 && 0 == pthread_create(&threads[started], NULL, lread_par_worker, &par))
+    {
+        started++;
+    }
+    lread_par_worker(&par);
+    for (int i = 0; i < started; i++) { pthread_join(threads[i], NULL); }
+    pthread_mutex_destroy(&par.lock);
+    if (LREAD_MODE_DIRECT != lread_mode) { lread_par_seal(cuts, num, 0); }
+
+    lval_t *v = NULL;
+    if (!par.failed)
+    {
+        int count = 0;
+        for (int i = 0; i < num; i++) { count += par.vs[i]->count; }
+
+        v = lval_sexpr();
+        v->cell = count? malloc(sizeof(lval_t *) * count): NULL;
+        for (int i = 0; i < num; i++)
+        {
+            memcpy(v->cell + v->count, par.vs[i]->cell, sizeof(lval_t *) * par.vs[i]->count);
+            v->count += par.vs[i]->count;
+            par.vs[i]->count = 0;
+        }
+    }
+
+    for (int i = 0; i < num; i++)
+    {
+        if (par.vs[i]) { lval_del(par.vs[i]); }
+    }
+    free(par.vs);
+    free(cuts);
+    return v;
+}
+
+#else
+
+static lval_t *lread_par(const char *filename, const char *input, size_t len)
+{
+    return NULL;
+}
+
+#endif
+
+/**
+ * 读取源文件。
+ *  普通文件通过 mmap 映射后直接在页缓存上读取，各种读取方式都不复制文件内容；
+ *  无法映射时（如管道）mpc 按文件或管道读取，手写读取器一次性读入内存。
+ *  与 mpc 一致，文件中的 '\0' 视为输入结束。
+ *  设置了缓存目录时先查找编译缓存，命中时不经过读取器，未命中时读取成功的结果写入缓存。
+ *  缓存的表达式与读取结果一样检查嵌套层数，--max-depth 不随缓存是否命中而变化。
+ */
+lval_t *lread_file(const char *filename, char **err)
+{
+    lcache_key_t key;
+    lval_t *v = lcache_find_stat(&key, filename);
+    if (v)
+    {
+        lcache_done(&key);
+        return lread_check_depth(filename, v, err);
+    }
+
+    /* 文件只映射一次，查找缓存、并行读取与顺序读取都在同一个映射上进行。*/
+    size_t mlen;
+    char *mbuf = mpc_map_file(filename, &mlen);
+    if (mbuf)
+    {
+        size_t len = strlen(mbuf);
+        v = lcache_find(&key, mbuf, len);
+        if (NULL == v)
+        {
+            v = lread_par(filename, mbuf, len);
+            if (NULL == v) { v = lread(filename, mbuf, err); }
+            if (v) { lcache_store(&key, v); }
+        }
+        else
+        {
+            v = lread_check_depth(filename, v, err);
+        }
+        mpc_unmap_file(mbuf, mlen);
+        lcache_done(&key);
+        return v;
+    }
+    lcache_done(&key);
+
+    if (LREAD_MODE_DIRECT != lread_mode)
+    {
+        mpc_result_t res;
+        return lread_mpc(filename, &res, mpc_parse_contents(filename, lread_mpc_parser(), &res), err);
+    }
+
+    FILE *f = fopen(filename, "rb");
+    if (NULL == f)
+    {
+        lread_t r;
+        r.filename = filename;
+        lread_fail(&r, "Unable to open file!");
+        *err = r.err;
+        return NULL;
+    }
+
+    size_t len = 0, cap = 4096;
+    char *buf = malloc(cap);
+    size_t n;
+    while ((n = fread(buf + len, 1, cap - len - 1, f)) > 0)
+    {
+        len += n;
+        if (cap - len - 1 == 0)
+        {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    buf[len] = '\0';
+    fclose(f);
+
+    v = lread(filename, buf, err);
+    free(buf);
+    return v;
+}
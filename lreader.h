@@ -0,0 +1,50 @@
+/*******
+ * Lispy Reader 源码读取模块。
+ *  针对固定的 Lispy 语法手写的单遍读取器，直接扫描输入缓冲区构造 lval，
+ *  不经过 mpc 组合子与 AST，错误信息（含行列号）与 mpc 保持一致。
+ */
+#ifndef lreader_h
+#define lreader_h
+
+#include "lvalues.h"
+
+
+/* 头文件循环嵌套，前置声明。*/
+#ifndef predefinition
+#define predefinition
+struct lenv_s;
+typedef struct lenv_s lenv_t;
+struct lval_s;
+typedef struct lval_s lval_t;
+typedef lval_t *(*lbuiltin)(lenv_t*, lval_t*);  // 路由器函数指针类型
+#endif
+
+
+/* 读取方式 */
+enum lread_modes
+{
+    LREAD_MODE_DIRECT,  // 手写读取器（默认）
+    LREAD_MODE_MPC,     // mpc 组合子语法，匹配时直接构造 lval，--mpc 命令行参数
+    LREAD_MODE_MPC_AST, // mpca_lang 语法生成 AST 后再由 lval_read 遍历，--mpc-ast 命令行参数
+};
+
+extern int lread_mode;
+extern int lread_packrat;  // mpc 语法的各条规则启用 packrat 记忆化，--packrat 命令行参数
+extern int lread_jobs;     // 并行读取大文件的线程数目，0 表示按 CPU 核数，--jobs=N 命令行参数
+extern int lread_max_depth; // 列表最大嵌套层数，0 表示只受内存限制，--max-depth=N 命令行参数
+
+/**
+ * 读取函数
+ *  成功时返回包含所有顶层表达式的 S-Expression；
+ *  失败时返回 NULL，err 指向与 mpc_err_string 格式相同的错误信息，由调用者释放。
+ */
+lval_t *lread(const char *filename, const char *input, char **err);
+lval_t *lread_file(const char *filename, char **err);
+
+/* 输出 packrat 记忆化的命中统计 */
+void lread_report(void);
+
+/* 释放 mpc 语法解析器 */
+void lread_cleanup(void);
+
+#endif
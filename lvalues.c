@@ -1,11 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 #include "lvalues.h"
 #include "lassert.h"
 
-#define ERR_MSG_BUFFER 512  // 错误信息缓存长度
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* lispy.c 中 mpca_lang 语法的规则，lval_read 按规则编号识别 AST 节点。*/
+extern mpc_parser_t* Number;
+extern mpc_parser_t* Symbol;
+extern mpc_parser_t* String;
+extern mpc_parser_t* Comment;
+extern mpc_parser_t* Qexpr;
+extern mpc_parser_t* Expr;
 
 
 /* Lispy Values 用户输入数据类型 */
@@ -18,6 +34,9 @@ char *ltype_name(int t) {
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
         case LVAL_FUN:   return "Function";
+        case LVAL_DICT:  return "Dictionary";
+        case LVAL_MAP:   return "Map";
+        case LVAL_SB:    return "String Builder";
         default:         return "Unknown";
     }
 }
@@ -34,37 +53,500 @@ lval_t *lval_num(long x) {
     return v;
 }
 
-lval_t *lval_err(char *fmt, ...)
+#define LERR_SHARED_MAX 64  // 共享的静态错误单例数目上限
+
+/* 共享的静态错误单例，以格式字符串指针和错误码为键。并行读取的多个线程可能同时查找或登记，由互斥锁保护。*/
+static lval_t *lerr_shared[LERR_SHARED_MAX];
+static int lerr_shared_num = 0;
+#ifndef _WIN32
+static pthread_mutex_t lerr_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * 按实际使用的长度分配错误 lval，错误载荷紧随 lval 之后，只需一次 malloc。
+ */
+static lval_t *lval_err_alloc(const lerr_t *err)
 {
-    lval_t *v = malloc(sizeof(lval_t));
+    size_t n = offsetof(lerr_t, strs) + err->strs_len;
+    lval_t *v = malloc(sizeof(lval_t) + n);
     v->type = LVAL_ERR;
+    v->err = (lerr_t *)(v + 1);
+    memcpy(v->err, err, n);
+    return v;
+}
+
+/**
+ * 按照格式字符串捕获格式化参数，只支持 %s、%i、%d 及其 l 修饰形式。
+ *  参数过多、字符串过长或遇到其他格式时返回 0，由调用者立即渲染。
+ */
+static int lerr_capture(lerr_t *err, va_list va)
+{
+    for (char *p = err->fmt; *p; p++)
+    {
+        if ('%' != *p) { continue; }
+        p++;
+        if ('%' == *p) { continue; }
+
+        int is_long = 0;
+        if ('l' == *p) { is_long = 1; p++; }
+        if (LERR_ARGS_MAX == err->argc) { return 0; }
+
+        switch (*p)
+        {
+            case 's':
+            {
+                char *s = va_arg(va, char *);
+                size_t n = strlen(s);
+                if (err->strs_len + n + 1 > LERR_STRS_MAX) { return 0; }
+                memcpy(err->strs + err->strs_len, s, n + 1);
+                err->args[err->argc++] = (long)err->strs_len;
+                err->strs_len += n + 1;
+                break;
+            }
+            case 'i':
+            case 'd':
+                err->args[err->argc++] = is_long? va_arg(va, long): va_arg(va, int);
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* 查找错误码与格式字符串相同的单例，不存在时登记一个新的单例，单例数目已满时返回 NULL。*/
+static lval_t *lerr_shared_get(lerr_t *err)
+{
+    lval_t *v = NULL;
+
+#ifndef _WIN32
+    pthread_mutex_lock(&lerr_shared_lock);
+#endif
+    for (int i = 0; i < lerr_shared_num; i++)
+    {
+        if (lerr_shared[i]->err->fmt == err->fmt && lerr_shared[i]->err->code == err->code)
+        {
+            v = lerr_shared[i];
+            break;
+        }
+    }
+    if (NULL == v && lerr_shared_num < LERR_SHARED_MAX)
+    {
+        err->shared = 1;
+        v = lval_err_alloc(err);
+        lerr_shared[lerr_shared_num++] = v;
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&lerr_shared_lock);
+#endif
+    return v;
+}
+
+static lval_t *lval_err_va(int code, char *fmt, va_list va)
+{
+    lerr_t err;
+    err.code = code;
+    err.shared = 0;
+    err.fmt = fmt;
+    err.argc = 0;
+    err.strs_len = 0;
 
+    /* 不含格式化参数的静态错误信息使用共享单例，不再分配内存。*/
+    if (NULL == strchr(fmt, '%'))
+    {
+        lval_t *v = lerr_shared_get(&err);
+        if (v) { return v; }
+    }
+
+    va_list cp;
+    va_copy(cp, va);
+    if (!lerr_capture(&err, va))
+    {
+        /* 无法延迟渲染的错误信息立即格式化，作为唯一的字符串参数保存。*/
+        vsnprintf(err.strs, LERR_STRS_MAX, fmt, cp);
+        err.fmt = "%s";
+        err.argc = 1;
+        err.args[0] = 0;
+        err.strs_len = strlen(err.strs) + 1;
+    }
+    va_end(cp);
+    return lval_err_alloc(&err);
+}
+
+lval_t *lval_err(char *fmt, ...)
+{
     va_list va;
     va_start(va, fmt);
+    lval_t *v = lval_err_va(LERR_OTHER, fmt, va);
+    va_end(va);
+    return v;
+}
 
-    v->err = malloc(ERR_MSG_BUFFER);
-    vsnprintf(v->err, ERR_MSG_BUFFER-1, fmt, va);
-    v->err = realloc(v->err, strlen(v->err) + 1);
-
+lval_t *lval_errc(int code, char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    lval_t *v = lval_err_va(code, fmt, va);
     va_end(va);
     return v;
 }
 
+lval_t *lval_err_copy(lval_t *v)
+{
+    return v->err->shared? v: lval_err_alloc(v->err);
+}
+
+/**
+ * 将错误信息渲染到 buf 中，超出 size 的部分被截断，返回渲染后的长度。
+ */
+size_t lval_err_str(lval_t *v, char *buf, size_t size)
+{
+    lerr_t *err = v->err;
+    size_t n = 0;
+    int k = 0;
+
+    for (char *p = err->fmt; *p && n + 1 < size; p++)
+    {
+        if ('%' != *p) { buf[n++] = *p; continue; }
+        p++;
+        if ('%' == *p) { buf[n++] = '%'; continue; }
+        if ('l' == *p) { p++; }
+
+        int w = ('s' == *p)? snprintf(buf + n, size - n, "%s", err->strs + err->args[k])
+                           : snprintf(buf + n, size - n, "%ld", err->args[k]);
+        k++;
+        n += (n + w < size)? (size_t)w: size - n - 1;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
 lval_t *lval_sym(char *s)
+{
+    return lval_sym_n(s, strlen(s));
+}
+
+lval_t *lval_sym_n(const char *s, size_t len)
 {
     lval_t *v = malloc(sizeof(lval_t));
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    v->sym = malloc(len + 1);
+    memcpy(v->sym, s, len);
+    v->sym[len] = '\0';
     return v;
 }
 
-lval_t *lval_str(char *s)
+/**
+ * 分配可容纳 cap 个字符的字符串，内容由调用方填写。
+ *  不超过 LVAL_SSO_MAX 的字符串内联存储，否则分配共享缓冲区。
+ */
+static lval_t *lval_str_alloc(size_t cap)
 {
     lval_t *v = malloc(sizeof(lval_t));
     v->type = LVAL_STR;
-    v->str = malloc(strlen(s) + 1);
-    strcpy(v->str, s);
+    v->len = 0;
+
+    if (cap <= LVAL_SSO_MAX)
+    {
+        v->sbuf = NULL;
+        v->str = v->sso;
+    }
+    else
+    {
+        v->sbuf = malloc(sizeof(lstr_buf_t) + cap + 1);
+        v->sbuf->refs = 1;
+        v->sbuf->cap = cap;
+        v->str = v->sbuf->data;
+    }
+    v->str[0] = '\0';
+    return v;
+}
+
+lval_t *lval_str_n(const char *s, size_t len)
+{
+    lval_t *v = lval_str_alloc(len);
+    memcpy(v->str, s, len);
+    v->str[len] = '\0';
+    v->len = len;
+    return v;
+}
+
+lval_t *lval_str(char *s)
+{
+    return lval_str_n(s, strlen(s));
+}
+
+void lval_str_copy(lval_t *dst, lval_t *src)
+{
+    dst->len = src->len;
+    dst->sbuf = src->sbuf;
+
+    if (src->sbuf)
+    {
+        src->sbuf->refs++;
+        dst->str = src->sbuf->data;
+    }
+    else
+    {
+        memcpy(dst->sso, src->sso, src->len + 1);
+        dst->str = dst->sso;
+    }
+}
+
+/**
+ * 字符串查找内核：在 hay[0, n) 中查找 needle[0, m)，返回首次出现的偏移，找不到返回 -1。
+ *  单字符直接使用 memchr。短模式串使用 SIMD 同时比较每个候选位置的首字符和尾字符，
+ *  两者都匹配的位置才逐字节比较中间部分，不支持 SIMD 的平台逐字节扫描。
+ *  候选位置的逐字节比较在重复性强的输入上会退化为 O(n·m)，失配比较的字节数超出扫描长度的常数倍后，
+ *  剩余部分改用 Two-Way 算法，最坏情况下也是线性时间。
+ */
+#define LSTR_VERIFY_RATIO 4     // 平均每个扫描字节允许的失配比较字节数
+#define LSTR_VERIFY_SLACK 4096  // 失配比较字节数的固定余量
+
+static int lstr_ctz(unsigned int x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(x);
+#else
+    int n = 0;
+    while (0 == (x & 1)) { x >>= 1; n++; }
+    return n;
+#endif
+}
+
+/**
+ * 求 x[0, m) 的最大后缀，rev 为 1 时按相反的字母序。
+ *  返回后缀起点的前一个位置（可能为 -1），*period 为该后缀的周期。
+ */
+static long lstr_max_suffix(const unsigned char *x, long m, int rev, long *period)
+{
+    long ms = -1, j = 0, k = 1, p = 1;
+    while (j + k < m)
+    {
+        unsigned char a = x[j + k];
+        unsigned char b = x[ms + k];
+        if (a == b)
+        {
+            if (k == p) { j += p; k = 1; }
+            else        { k++; }
+        }
+        else if ((a < b) != rev)
+        {
+            j += k;
+            k = 1;
+            p = j - ms;
+        }
+        else
+        {
+            ms = j;
+            j = ms + 1;
+            k = p = 1;
+        }
+    }
+    *period = p;
+    return ms;
+}
+
+/**
+ * Two-Way 查找（Crochemore-Perrin）。
+ *  模式串在临界位置 ell 处分为左右两半，先从左到右比较右半部分，失配时按已匹配的长度移动；
+ *  右半部分匹配后再从右到左比较左半部分。模式串有周期 per 时记住已经匹配的前缀，
+ *  每个字节最多比较常数次，总时间 O(n + m)，只需常数额外空间。
+ */
+static long lstr_find_twoway(const unsigned char *y, long n, const unsigned char *x, long m)
+{
+    long p, q;
+    long i = lstr_max_suffix(x, m, 0, &p);
+    long j = lstr_max_suffix(x, m, 1, &q);
+    long ell = (i > j)? i: j;
+    long per = (i > j)? p: q;
+
+    if (0 == memcmp(x, x + per, ell + 1))
+    {
+        long memory = -1;
+        for (j = 0; j <= n - m; )
+        {
+            i = ((ell > memory)? ell: memory) + 1;
+            while (i < m && x[i] == y[i + j]) { i++; }
+            if (i < m)
+            {
+                j += i - ell;
+                memory = -1;
+                continue;
+            }
+
+            i = ell;
+            while (i > memory && x[i] == y[i + j]) { i--; }
+            if (i <= memory) { return j; }
+            j += per;
+            memory = m - per - 1;
+        }
+        return -1;
+    }
+
+    per = ((ell + 1 > m - ell - 1)? ell + 1: m - ell - 1) + 1;
+    for (j = 0; j <= n - m; )
+    {
+        i = ell + 1;
+        while (i < m && x[i] == y[i + j]) { i++; }
+        if (i < m)
+        {
+            j += i - ell;
+            continue;
+        }
+
+        i = ell;
+        while (i >= 0 && x[i] == y[i + j]) { i--; }
+        if (i < 0) { return j; }
+        j += per;
+    }
+    return -1;
+}
+
+long lstr_find(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if (0 == m) { return 0; }
+    if (m > n)  { return -1; }
+
+    if (1 == m)
+    {
+        const char *p = memchr(hay, needle[0], n);
+        return p? p - hay: -1;
+    }
+
+    size_t i = 0;
+    size_t work = 0;  // 失配的逐字节比较已经比较过的字节数上限
+
+#if defined(__AVX2__)
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last  = _mm256_set1_epi8(needle[m-1]);
+    for (; i + m - 1 + 32 <= n && work <= i * LSTR_VERIFY_RATIO + LSTR_VERIFY_SLACK; i += 32)
+    {
+        __m256i bf = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        unsigned int mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(last, bl)));
+        while (mask)
+        {
+            int bit = lstr_ctz(mask);
+            if (0 == memcmp(hay + i + bit + 1, needle + 1, m - 2)) { return i + bit; }
+            work += m - 2;
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last  = _mm_set1_epi8(needle[m-1]);
+    for (; i + m - 1 + 16 <= n && work <= i * LSTR_VERIFY_RATIO + LSTR_VERIFY_SLACK; i += 16)
+    {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+        while (mask)
+        {
+            int bit = lstr_ctz(mask);
+            if (0 == memcmp(hay + i + bit + 1, needle + 1, m - 2)) { return i + bit; }
+            work += m - 2;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i + m <= n && work <= i * LSTR_VERIFY_RATIO + LSTR_VERIFY_SLACK; i++)
+    {
+        if (hay[i] == needle[0] && hay[i+m-1] == needle[m-1])
+        {
+            if (0 == memcmp(hay + i + 1, needle + 1, m - 2)) { return i; }
+            work += m - 2;
+        }
+    }
+    if (i + m > n) { return -1; }
+
+    long found = lstr_find_twoway((const unsigned char *)hay + i, n - i, (const unsigned char *)needle, m);
+    return (found < 0)? -1: (long)i + found;
+}
+
+/**
+ * 拼接字符串列表，相邻字符串之间插入 sep（可为 NULL）。先计算总长度，只分配一次。
+ */
+lval_t *lval_str_concat(lval_t **xs, int n, lval_t *sep)
+{
+    size_t sep_len = sep? sep->len: 0;
+    size_t len = 0;
+    for (int i=0; i < n; i++)
+    {
+        len += xs[i]->len + (i? sep_len: 0);
+    }
+
+    lval_t *v = lval_str_alloc(len);
+    char *d = v->str;
+    for (int i=0; i < n; i++)
+    {
+        if (i && sep_len) { memcpy(d, sep->str, sep_len); d += sep_len; }
+        memcpy(d, xs[i]->str, xs[i]->len);
+        d += xs[i]->len;
+    }
+    *d = '\0';
+    v->len = len;
+    return v;
+}
+
+/**
+ * 按分隔符拆分字符串，返回字符串组成的 Q-Expression。sep 不能为空串。
+ */
+lval_t *lval_str_split(lval_t *s, lval_t *sep)
+{
+    lval_t *x = lval_qexpr();
+    size_t pos = 0;
+
+    while (1)
+    {
+        long found = lstr_find(s->str + pos, s->len - pos, sep->str, sep->len);
+        if (found < 0) { break; }
+
+        lval_add(x, lval_str_n(s->str + pos, found));
+        pos += found + sep->len;
+    }
+    lval_add(x, lval_str_n(s->str + pos, s->len - pos));
+    return x;
+}
+
+/**
+ * 替换字符串中所有的 from 为 to。from 不能为空串。
+ *  第一遍统计匹配次数以确定结果长度，第二遍直接写入结果。
+ */
+lval_t *lval_str_replace(lval_t *s, lval_t *from, lval_t *to)
+{
+    size_t hits = 0;
+    long found;
+    for (size_t pos=0; (found = lstr_find(s->str + pos, s->len - pos, from->str, from->len)) >= 0; )
+    {
+        hits++;
+        pos += found + from->len;
+    }
+    if (0 == hits) { return lval_str_n(s->str, s->len); }
+
+    size_t len = s->len - hits * from->len + hits * to->len;
+    lval_t *v = lval_str_alloc(len);
+    char *d = v->str;
+
+    for (size_t pos=0; ; )
+    {
+        found = lstr_find(s->str + pos, s->len - pos, from->str, from->len);
+        if (found < 0)
+        {
+            memcpy(d, s->str + pos, s->len - pos);
+            d += s->len - pos;
+            break;
+        }
+
+        memcpy(d, s->str + pos, found);           d += found;
+        memcpy(d, to->str, to->len);              d += to->len;
+        pos += found + from->len;
+    }
+    *d = '\0';
+    v->len = len;
     return v;
 }
 
@@ -105,14 +587,110 @@ lval_t *lval_lambda(lval_t *formals, lval_t *body)
     return v;
 }
 
+lval_t *lval_dict(void)
+{
+    lval_t *v = malloc(sizeof(lval_t));
+    v->type = LVAL_DICT;
+    v->dict = ldict_new();
+    return v;
+}
+
+lval_t *lval_map(void)
+{
+    lval_t *v = malloc(sizeof(lval_t));
+    v->type = LVAL_MAP;
+    v->map = lmap_new();
+    return v;
+}
+
+lval_t *lval_sb(void)
+{
+    lval_t *v = malloc(sizeof(lval_t));
+    v->type = LVAL_SB;
+    v->sb = NULL;
+    v->sb_count = 0;
+    v->len = 0;
+    return v;
+}
+
+static void lsb_buf_unref(lsb_buf_t *buf)
+{
+    if (NULL == buf || --buf->refs > 0) { return; }
+    for (int i=0; i < buf->count; i++)
+    {
+        lval_del(buf->pieces[i]);
+    }
+    free(buf->pieces);
+    free(buf);
+}
+
+/**
+ * 追加字符串片段，构建器接管 s 的所有权。
+ *  构建器位于共享缓冲区末尾时直接追加（均摊 O(1)），
+ *  否则说明缓冲区已被其他构建器追加过，需要复制本构建器的片段前缀。
+ */
+void lval_sb_append(lval_t *b, lval_t *s)
+{
+    lsb_buf_t *buf = b->sb;
+
+    if (NULL == buf || b->sb_count != buf->count)
+    {
+        lsb_buf_t *n = malloc(sizeof(lsb_buf_t));
+        n->refs = 1;
+        n->count = b->sb_count;
+        n->cap = b->sb_count > 4? b->sb_count * 2: 8;
+        n->pieces = malloc(sizeof(lval_t *) * n->cap);
+        for (int i=0; i < b->sb_count; i++)
+        {
+            n->pieces[i] = lval_copy(buf->pieces[i]);
+        }
+
+        lsb_buf_unref(buf);
+        b->sb = buf = n;
+    }
+
+    if (buf->count == buf->cap)
+    {
+        buf->cap *= 2;
+        buf->pieces = realloc(buf->pieces, sizeof(lval_t *) * buf->cap);
+    }
+
+    buf->pieces[buf->count++] = s;
+    b->sb_count++;
+    b->len += s->len;
+}
+
+/**
+ * 拷贝构建器，只增加片段缓冲区的引用计数。
+ */
+void lval_sb_copy(lval_t *dst, lval_t *src)
+{
+    dst->sb = src->sb;
+    dst->sb_count = src->sb_count;
+    dst->len = src->len;
+    if (dst->sb) { dst->sb->refs++; }
+}
+
+/**
+ * 将所有片段拼接为一个字符串，总长度已知，只分配一次。
+ */
+lval_t *lval_sb_finish(lval_t *b)
+{
+    return lval_str_concat(b->sb? b->sb->pieces: NULL, b->sb_count, NULL);
+}
+
 void lval_del(lval_t *v)
 {
     switch (v->type)
     {
         case LVAL_NUM: break;
-        case LVAL_ERR: free(v->err); break;
+        case LVAL_ERR:
+            if (v->err->shared) { return; }  // 共享单例不释放，错误载荷随 lval 一起释放
+            break;
         case LVAL_SYM: free(v->sym); break;
-        case LVAL_STR: free(v->str); break;
+        case LVAL_STR:
+            if (v->sbuf && 0 == --v->sbuf->refs) { free(v->sbuf); }
+            break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             for (int i=0; i < v->count; i++)
@@ -129,6 +707,9 @@ void lval_del(lval_t *v)
                 lval_del(v->body);
             }
             break;
+        case LVAL_DICT: ldict_del(v->dict); break;
+        case LVAL_MAP: lmap_del(v->map); break;
+        case LVAL_SB: lsb_buf_unref(v->sb); break;
     }
     free(v);
 }
@@ -149,76 +730,158 @@ lval_t *lval_add(lval_t *parent, lval_t *children)
  * 数字读取函数
  *  将 String 转换为 Long，并存储。
  */
-static lval_t *lval_read_num(mpc_ast_t *t)
+lval_t *lval_read_num(const char *s)
 {
     errno = 0;
-    long x = strtol(t->contents, NULL, 10);
+    long x = strtol(s, NULL, 10);
     return ERANGE != errno? lval_num(x): lval_err("Invalid number.");
 }
 
+/* 转义字符解码，不是合法转义时返回 -1。*/
+static int lval_unescape_char(char c)
+{
+    switch (c)
+    {
+        case 'a':  return '\a';
+        case 'b':  return '\b';
+        case 'f':  return '\f';
+        case 'n':  return '\n';
+        case 'r':  return '\r';
+        case 't':  return '\t';
+        case 'v':  return '\v';
+        case '\\': return '\\';
+        case '\'': return '\'';
+        case '\"': return '\"';
+        case '0':  return '\0';
+        default:   return -1;
+    }
+}
+
 /**
  * 字符串读取函数
- * 	首先，它必须剥离字符串两侧 `"` 字符。
- * 	然后，必须对转义字符串进行解码，将一系列转义字符（如 `\n`）转换成实际编码字符。
- * 	最后，必须创建一个新的 lval 并清理函数中使用过的内存。
+ * 	s 为剥离两侧 `"` 字符后的原文，同时将转义字符（如 `\n`）解码为实际编码字符。
+ * 	解码结果不会比原文更长，因此按原文长度分配一次存储，直接解码到新的 lval 中。
  */
-lval_t *lval_read_str(mpc_ast_t *ast)
+lval_t *lval_read_str(const char *s, size_t raw)
 {
-    /* Cut off the final quote character */
-    ast->contents[strlen(ast->contents) - 1] = '\0';
 
-    /* Copy the string missing out the first quote character */
-    char *unescaped = malloc(strlen(ast->contents + 1) + 1);
-    strcpy(unescaped, ast->contents + 1);
+    lval_t *v = lval_str_alloc(raw);
+    char *d = v->str;
+    size_t n = 0;
 
-    /* Pass through the unescape function */
-    unescaped = mpcf_unescape(unescaped);
+    for (size_t i=0; i < raw; i++)
+    {
+        int c = ('\\' == s[i] && i + 1 < raw)? lval_unescape_char(s[i+1]): -1;
+        if (c < 0)
+        {
+            d[n++] = s[i];
+            continue;
+        }
 
-    /* Construct a new lval using the string */
-    lval_t *str = lval_str(unescaped);
+        if (c) { d[n++] = c; }  // 与 mpcf_unescape 一致，丢弃 \0
+        i++;
+    }
 
-    /* Free the string and return */
-    free(unescaped);
-    return str;
+    d[n] = '\0';
+    v->len = n;
+    return v;
 }
 
 /**
- * 接收 MPC AST，并根据树节点的 Tag 来读取相应的类型数据。
+ * 接收 MPC AST，并根据树节点匹配的语法规则来读取相应的类型数据。
+ *  规则由节点的规则位集合判断，Tag 字符串只用于打印。
+ *  根节点与 sexpr 读取为 S-Expression；子节点中只有 expr 规则匹配的节点是元素，括号与 /^/、/$/ 都不是。
  */
 lval_t *lval_read(mpc_ast_t *ast)
-{   
-    if (strstr(ast->tag, "number")) { return lval_read_num(ast); }      // 读取数据类型
-    if (strstr(ast->tag, "symbol")) { return lval_sym(ast->contents); } // 读取符号类型
-    if (strstr(ast->tag, "string")) { return lval_read_str(ast); }      // 读取字符串类型
-
-    lval_t *parent = NULL;
+{
+    if (mpc_ast_has_rule(ast, Number)) { return lval_read_num(ast->contents); } // 读取数据类型
+    if (mpc_ast_has_rule(ast, Symbol)) { return lval_sym(ast->contents); }      // 读取符号类型
+    if (mpc_ast_has_rule(ast, String))                                          // 读取字符串类型
+    {
+        return lval_read_str(ast->contents + 1, strlen(ast->contents) - 2);
+    }
 
-    if (0 == strcmp(ast->tag, ">")) { parent = lval_sexpr(); }
-    if (strstr(ast->tag, "sexpr"))  { parent = lval_sexpr(); }
-    if (strstr(ast->tag, "qexpr"))  { parent = lval_qexpr(); }
+    lval_t *parent = mpc_ast_has_rule(ast, Qexpr)? lval_qexpr(): lval_sexpr();
 
     for (int i=0; i < ast->children_num; i++)
     {
-        if (0 == strcmp(ast->children[i]->contents, "(")) { continue; }
-        if (0 == strcmp(ast->children[i]->contents, ")")) { continue; }
-        if (0 == strcmp(ast->children[i]->contents, "{")) { continue; }
-        if (0 == strcmp(ast->children[i]->contents, "}")) { continue; }
-        if (0 == strcmp(ast->children[i]->tag, "regex"))  { continue; }
-        if (strstr(ast->children[i]->tag, "comment")) { continue; }
+        mpc_ast_t *child = ast->children[i];
+        if (!mpc_ast_has_rule(child, Expr) || mpc_ast_has_rule(child, Comment)) { continue; }
 
-        parent = lval_add(parent, lval_read(ast->children[i]));  // 递归遍历 AST 树节点
+        parent = lval_add(parent, lval_read(child));  // 递归遍历 AST 树节点
     }
 
     return parent;
 }
 
 
+/**
+ * 输出缓冲区。
+ *  所有打印函数先写入该缓冲区，缓冲区写满、调用 flush 内建函数或程序退出时才写到 stdout。
+ */
+#define LVAL_PRINT_BUFFER (64 * 1024)  // 输出缓冲区长度
+
+static char   lval_print_buf[LVAL_PRINT_BUFFER];
+static size_t lval_print_len = 0;
+
+void lval_print_flush(void)
+{
+    fwrite(lval_print_buf, 1, lval_print_len, stdout);
+    fflush(stdout);
+    lval_print_len = 0;
+}
+
+static void lval_print_write(const char *s, size_t n)
+{
+    if (n > LVAL_PRINT_BUFFER - lval_print_len)
+    {
+        lval_print_flush();
+        if (n >= LVAL_PRINT_BUFFER)
+        {
+            fwrite(s, 1, n, stdout);  // 超过缓冲区长度的内容直接输出
+            return;
+        }
+    }
+    memcpy(lval_print_buf + lval_print_len, s, n);
+    lval_print_len += n;
+}
+
+void lval_print_char(char c)
+{
+    if (LVAL_PRINT_BUFFER == lval_print_len) { lval_print_flush(); }
+    lval_print_buf[lval_print_len++] = c;
+}
+
+static void lval_print_cstr(const char *s)
+{
+    lval_print_write(s, strlen(s));
+}
+
+/**
+ * 整数格式化，从低位向高位写入临时数组，避免 printf 的格式解析开销。
+ */
+static void lval_print_long(long x)
+{
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long u = x < 0? 0UL - (unsigned long)x: (unsigned long)x;
+
+    do
+    {
+        digits[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    if (x < 0) { digits[--i] = '-'; }
+    lval_print_write(digits + i, sizeof(digits) - i);
+}
+
 /**
  * 打印表达式。
  */
 static void lval_expr_print(lval_t *v, char open_flag, char close_flag)
 {
-    putchar(open_flag);
+    lval_print_char(open_flag);
     for (int i = 0; i < v->count; i++)
     {
         /* Print Value contained within */
@@ -227,10 +890,49 @@ static void lval_expr_print(lval_t *v, char open_flag, char close_flag)
         /* Don't print trailing space if last element */
         if (i != (v->count-1))
         {
-            putchar(' ');
+            lval_print_char(' ');
         }
     }
-    putchar(close_flag);
+    lval_print_char(close_flag);
+}
+
+/* 需要转义的字符对应的转义序列，与 mpcf_escape 一致，不需要转义的字符为 NULL。*/
+static const char *lval_escape_seq(char c)
+{
+    switch (c)
+    {
+        case '\a': return "\\a";
+        case '\b': return "\\b";
+        case '\f': return "\\f";
+        case '\n': return "\\n";
+        case '\r': return "\\r";
+        case '\t': return "\\t";
+        case '\v': return "\\v";
+        case '\\': return "\\\\";
+        case '\'': return "\\'";
+        case '\"': return "\\\"";
+        case '\0': return "\\0";
+        default:   return NULL;
+    }
+}
+
+/**
+ * 打印转义后的字符串内容，不含两侧的 `"`。
+ *  一次扫描，不需要转义的连续字符整段写入缓冲区，不分配内存。
+ */
+static void lval_print_escaped(const char *s, size_t len)
+{
+    size_t run = 0;
+    for (size_t i=0; i < len; i++)
+    {
+        const char *seq = lval_escape_seq(s[i]);
+        if (NULL == seq) { continue; }
+
+        lval_print_write(s + run, i - run);
+        lval_print_write(seq, 2);
+        run = i + 1;
+    }
+    lval_print_write(s + run, len - run);
 }
 
 /**
@@ -238,18 +940,62 @@ static void lval_expr_print(lval_t *v, char open_flag, char close_flag)
  */
 void lval_print_str(lval_t *v) {
 
-    /* Make a Copy of the string */
-    char *escaped = malloc(strlen(v->str) + 1);
-    strcpy(escaped, v->str);
+    /* Print it between " characters */
+    lval_print_char('"');
+    lval_print_escaped(v->str, v->len);
+    lval_print_char('"');
+}
 
-    /* Pass it through the escape function */
-    escaped = mpcf_escape(escaped);
+/**
+ * 打印字符串构建器，逐个片段输出，不拼接成完整字符串。
+ */
+static void lval_sb_print(lval_t *v)
+{
+    lval_print_char('"');
+    for (int i=0; i < v->sb_count; i++)
+    {
+        lval_print_escaped(v->sb->pieces[i]->str, v->sb->pieces[i]->len);
+    }
+    lval_print_char('"');
+}
 
-    /* Print it between " characters */
-    printf("\"%s\"", escaped);
+/**
+ * 打印字典，格式为 (dict k1 v1 k2 v2 ...)，按槽位顺序输出。
+ */
+static void lval_dict_print(lval_t *v)
+{
+    lval_print_cstr("(dict");
+    for (int i=0; i < v->dict->cap; i++)
+    {
+        ldict_entry_t *entry = &v->dict->entries[i];
+        if (NULL == entry->key) { continue; }
+
+        lval_print_char(' '); lval_print(entry->key);
+        lval_print_char(' '); lval_print(entry->val);
+    }
+    lval_print_char(')');
+}
 
-    /* free the copied string */
-    free(escaped);
+static void lval_map_print_pair(lval_t *k, lval_t *v, void *data)
+{
+    lval_print_char(' '); lval_print(k);
+    lval_print_char(' '); lval_print(v);
+}
+
+/**
+ * 打印持久化映射，格式为 (hmap k1 v1 k2 v2 ...)。
+ */
+static void lval_map_print(lval_t *v)
+{
+    lval_print_cstr("(hmap");
+    lmap_foreach(v->map, lval_map_print_pair, NULL);
+    lval_print_char(')');
+}
+
+static void lval_print_err(lval_t *v)
+{
+    char buf[LERR_MSG_MAX];
+    lval_print_write(buf, lval_err_str(v, buf, sizeof(buf)));
 }
 
 /**
@@ -259,20 +1005,23 @@ void lval_print(lval_t *v)
 {
     switch (v->type)
     {
-        case LVAL_NUM: printf("%li", v->num); break;
-        case LVAL_ERR: printf("%s", v->err); break;
-        case LVAL_SYM: printf("%s", v->sym); break;
+        case LVAL_NUM: lval_print_long(v->num); break;
+        case LVAL_ERR: lval_print_err(v); break;
+        case LVAL_SYM: lval_print_cstr(v->sym); break;
         case LVAL_STR: lval_print_str(v); break;
         case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
         case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+        case LVAL_DICT: lval_dict_print(v); break;
+        case LVAL_MAP: lval_map_print(v); break;
+        case LVAL_SB: lval_sb_print(v); break;
         case LVAL_FUN:
             if (v->builtin)
             {
-                printf("<builtin>");
+                lval_print_cstr("<builtin>");
             }
             else
             {
-                printf("(\\ "); lval_print(v->formals); putchar(' '); lval_print(v->body); putchar(')');
+                lval_print_cstr("(\\ "); lval_print(v->formals); lval_print_char(' '); lval_print(v->body); lval_print_char(')');
             }
             break;
     }
@@ -284,5 +1033,5 @@ void lval_print(lval_t *v)
 void lval_println(lval_t *v)
 {
     lval_print(v);
-    putchar('\n');
+    lval_print_char('\n');
 }
@@ -9,6 +9,8 @@
 
 #include "lenv.h"
 #include "lbuiltins.h"
+#include "ldict.h"
+#include "lmap.h"
 
 
 /* 头文件循环嵌套，前置声明。*/
@@ -22,7 +24,53 @@ typedef lval_t *(*lbuiltin)(lenv_t*, lval_t*);  // 路由器函数指针类型
 #endif
 
 
-/* Lispy Values 用户输入数据存储器数据结构。*/
+#define LVAL_SSO_MAX 15  // 不超过该长度的字符串直接内联存储在 lval 中
+
+/* 长字符串的共享缓冲区，创建后内容不再修改，通过引用计数在多个 lval 之间共享。*/
+typedef struct lstr_buf_s
+{
+    int    refs;    // 引用计数
+    size_t cap;     // 可容纳的字符数目，不含结尾的 '\0'
+    char   data[];  // 字符串内容
+} lstr_buf_t;
+
+/**
+ * 字符串构建器的片段缓冲区，多个构建器可以共享同一个缓冲区的前缀。
+ *  构建器的片段数目等于缓冲区片段数目时可以直接在末尾追加，否则复制前缀后再追加。
+ */
+typedef struct lsb_buf_s
+{
+    int    refs;            // 引用计数
+    int    count;           // 已追加的片段数目
+    int    cap;             // 可容纳的片段数目
+    struct lval_s **pieces; // 字符串片段
+} lsb_buf_t;
+
+#define LERR_ARGS_MAX 6    // 错误信息最多捕获的格式化参数数目
+#define LERR_STRS_MAX 512  // 错误信息字符串参数副本的总长度
+#define LERR_MSG_MAX  512  // 渲染后的错误信息最大长度
+
+/**
+ * 错误信息载荷，与错误 lval 在同一块内存中分配。
+ *  构造时只记录错误码、格式字符串指针和格式化参数，打印或比较时才渲染成完整的错误信息。
+ *  格式字符串必须是静态字符串，字符串参数则复制到 strs 中，strs 只按实际长度分配。
+ */
+typedef struct lerr_s
+{
+    int    code;                // 错误码
+    int    shared;              // 是否为共享的静态错误单例，单例不会被释放
+    char   *fmt;                // 错误信息格式
+    int    argc;                // 已捕获的参数数目
+    long   args[LERR_ARGS_MAX]; // 整数参数的值，或字符串参数在 strs 中的偏移
+    size_t strs_len;            // strs 已使用的长度
+    char   strs[LERR_STRS_MAX]; // 字符串参数副本
+} lerr_t;
+
+/**
+ * Lispy Values 用户输入数据存储器数据结构。
+ *  函数、字符串、字符串构建器与字典各自的字段只在对应类型下使用，放在同一个联合体中共用存储，
+ *  其他类型的值不必携带字符串的内联缓冲区。
+ */
 struct lval_s
 {
     int      type;  // 用户输入的数据类型标记
@@ -30,18 +78,43 @@ struct lval_s
     /* Basic */
     long     num;   // 操作数
     char     *sym;  // 操作符号
-    char     *err;  // 错误处理信息
-    char     *str;  // 字符串
-
-    /* Function */
-    lbuiltin builtin;       // 操作函数指针
-    struct lenv_s *env;     // 函数运行时环境
-    struct lval_s *formals; // 函数参数列表
-    struct lval_s *body;    // 函数运算结果
+    lerr_t   *err;  // 错误处理信息
+    size_t   len;   // 字符串长度，字符串构建器中为所有片段的总长度
 
     /* Expression */
     int      count;         // 子节点数量
     struct lval_s **cell;   // 子节点，指针数组类型 
+
+    union
+    {
+        /* Function */
+        struct
+        {
+            lbuiltin builtin;       // 操作函数指针
+            struct lenv_s *env;     // 函数运行时环境
+            struct lval_s *formals; // 函数参数列表
+            struct lval_s *body;    // 函数运算结果
+        };
+
+        /* String */
+        struct
+        {
+            char     *str;                  // 字符串，指向 sso 或 sbuf->data，总是以 '\0' 结尾
+            char     sso[LVAL_SSO_MAX + 1]; // 短字符串内联存储
+            lstr_buf_t *sbuf;               // 长字符串共享缓冲区，短字符串为 NULL
+        };
+
+        /* String Builder */
+        struct
+        {
+            lsb_buf_t *sb;          // 片段缓冲区
+            int      sb_count;      // 本构建器使用的片段数目
+        };
+
+        /* Dictionary */
+        struct ldict_s *dict;   // 哈希表
+        struct lmap_s  *map;    // 持久化哈希映射
+    };
 };
 
 /* Lispy Values 用户输入数据的类型。*/
@@ -54,30 +127,76 @@ enum ltypes
     LVAL_QEXPR, // Q-Expression 类型
     LVAL_FUN,   // 函数类型
     LVAL_ERR,   // 错误类型
+    LVAL_DICT,  // 字典类型
+    LVAL_MAP,   // 持久化映射类型
+    LVAL_SB,    // 字符串构建器类型
 };
 
 char *ltype_name(int t);
 
+/* 错误码 */
+enum lerr_codes
+{
+    LERR_NONE,      // 没有错误，catch 成功时返回
+    LERR_OTHER,     // 其他错误
+    LERR_USER,      // 用户通过 error 函数抛出的错误
+    LERR_ARG_NUM,   // 参数数目错误
+    LERR_ARG_TYPE,  // 参数类型错误
+    LERR_ARG_EMPTY, // 参数为空列表
+    LERR_UNBOUND,   // 符号未绑定
+    LERR_DIV_ZERO,  // 除数为零
+    LERR_NOT_FOUND, // 字典中不存在该键
+    LERR_LOAD,      // 源文件加载失败
+};
+
 
 /* 构造函数 */
 lval_t *lval_num(long x);
 lval_t *lval_sym(char *s);
+lval_t *lval_sym_n(const char *s, size_t len);
 lval_t *lval_sexpr(void);
 lval_t *lval_str(char *s);
+lval_t *lval_str_n(const char *s, size_t len);
 lval_t *lval_qexpr(void);
 lval_t *lval_fun(lbuiltin func);
 lval_t *lval_err(char *fmt, ...);
+lval_t *lval_errc(int code, char *fmt, ...);
 lval_t *lval_lambda(lval_t *formals, lval_t *body);
+lval_t *lval_dict(void);
+lval_t *lval_map(void);
+lval_t *lval_sb(void);
+
+/* 字符串拷贝函数，长字符串只增加共享缓冲区的引用计数。*/
+void lval_str_copy(lval_t *dst, lval_t *src);
+
+/* 错误拷贝与渲染函数，共享的静态错误单例拷贝时直接返回自身。*/
+lval_t *lval_err_copy(lval_t *v);
+size_t lval_err_str(lval_t *v, char *buf, size_t size);
+
+/* 字符串操作函数 */
+long lstr_find(const char *hay, size_t n, const char *needle, size_t m);
+lval_t *lval_str_concat(lval_t **xs, int n, lval_t *sep);
+lval_t *lval_str_split(lval_t *s, lval_t *sep);
+lval_t *lval_str_replace(lval_t *s, lval_t *from, lval_t *to);
+
+/* 字符串构建器函数 */
+void lval_sb_append(lval_t *b, lval_t *s);
+void lval_sb_copy(lval_t *dst, lval_t *src);
+lval_t *lval_sb_finish(lval_t *b);
 
 /* 析构函数 */
 void lval_del(lval_t *v);
 
 /* 用户输入读取与存储函数 */
 lval_t *lval_read(mpc_ast_t *t);
+lval_t *lval_read_num(const char *s);
+lval_t *lval_read_str(const char *s, size_t raw);
 
 /* 运算结果打印函数 */
 void lval_print(lval_t *v);
 void lval_println(lval_t *v);
+void lval_print_char(char c);
+void lval_print_flush(void);
 
 /* 将子节点追加到父节点的指针数组中。*/
 lval_t *lval_add(lval_t *parent, lval_t *children);
@@ -1,3 +1,11 @@
+#ifndef _WIN32
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "mpc.h"
 
 /*
@@ -41,15 +49,17 @@ static mpc_state_t mpc_state_new(void) {
 ** by seeking in the file at different positions.
 **
 ** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and
-** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
+** one. As we assume pipes cannot be seeked, every
+** character read from the pipe goes into a buffer
+** and is read back from there.
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer instead of the input. Only characters
+** at or after the oldest mark (or the current
+** position if there is no mark) are kept, so
+** the buffer stays as small as the backtracking
+** allows.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -64,16 +74,135 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MARKS_MIN = 32
+  MPC_INPUT_MARKS_MIN = 32,
+  MPC_INPUT_BUFFER_MIN = 4096
 };
 
+/*
+** Parse-time allocations come from a bump arena owned by
+** the input. Blocks are rounded up to a power of two and
+** freed blocks go onto a free list for their size class,
+** so both allocation and release are O(1). All chunks are
+** released together when the input is deleted; values
+** handed back to the caller are copied out by mpc_export.
+*/
+
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_ARENA_CHUNK_MIN = 4096,
+  MPC_ARENA_CLASS_MIN = 16,
+  MPC_ARENA_CLASSES   = 7,
+  MPC_ARENA_MAX       = 1024
+};
+
+typedef struct mpc_arena_chunk_t {
+  struct mpc_arena_chunk_t *next;
+  char *end;
+} mpc_arena_chunk_t;
+
+/*
+** Packrat memo entries, keyed by parser, input offset and
+** whether errors are suppressed. The table lives in the
+** arena, starts small and doubles up to MPC_MEMO_MAX slots;
+** past that a new entry evicts the one in its home slot.
+*/
+
+#ifndef MPC_MEMO_MAX
+#define MPC_MEMO_MAX 65536
+#endif
+
+enum {
+  MPC_MEMO_MIN   = 256,
+  MPC_MEMO_PROBE = 8
 };
 
 typedef struct {
-  char mem[64];
-} mpc_mem_t;
+  mpc_parser_t *p;
+  long pos;
+  int suppress;
+  int ok;
+  mpc_state_t end;
+  char last;
+  mpc_result_t result;
+  mpc_err_t *merged;
+} mpc_memo_t;
+
+/*
+** AST nodes built while parsing with an `mpca_lang` rule,
+** along with their tags, contents and child arrays, are
+** bumped from an arena that outlives the input and is handed
+** to the root of the result. Heap trees attached to one of
+** its nodes are listed so they are deleted along with it.
+*/
+
+enum {
+  MPC_AST_CHUNK_MIN = 4096,
+  MPC_AST_CHUNK_MAX = 1048576
+};
+
+typedef struct mpc_ast_arena_t {
+  mpc_arena_chunk_t *chunks;
+  size_t size;
+  char *ptr;
+  char *end;
+  mpc_ast_t *root;
+  int foreign_num;
+  int foreign_slots;
+  mpc_ast_t **foreign;
+} mpc_ast_arena_t;
+
+static mpc_ast_arena_t *mpc_ast_arena_new(void) {
+  return calloc(1, sizeof(mpc_ast_arena_t));
+}
+
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *a, size_t n) {
+  char *p;
+  size_t size;
+  mpc_arena_chunk_t *c;
+  n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  if ((size_t)(a->end - a->ptr) < n) {
+    a->size = a->size ? a->size * 2 : MPC_AST_CHUNK_MIN;
+    if (a->size > MPC_AST_CHUNK_MAX) { a->size = MPC_AST_CHUNK_MAX; }
+    size = a->size < n ? n : a->size;
+    c = malloc(sizeof(mpc_arena_chunk_t) + size);
+    c->next = a->chunks;
+    c->end = (char*)(c + 1) + size;
+    a->chunks = c;
+    a->ptr = (char*)(c + 1);
+    a->end = c->end;
+  }
+  p = a->ptr;
+  a->ptr += n;
+  return p;
+}
+
+static char *mpc_ast_arena_strdup(mpc_ast_arena_t *a, const char *s) {
+  size_t n = strlen(s) + 1;
+  char *p = mpc_ast_arena_alloc(a, n);
+  memcpy(p, s, n);
+  return p;
+}
+
+static void mpc_ast_arena_adopt(mpc_ast_arena_t *a, mpc_ast_t *x) {
+  if (a->foreign_num == a->foreign_slots) {
+    a->foreign_slots = a->foreign_slots ? a->foreign_slots * 2 : 4;
+    a->foreign = realloc(a->foreign, sizeof(mpc_ast_t*) * a->foreign_slots);
+  }
+  a->foreign[a->foreign_num++] = x;
+}
+
+static void mpc_ast_arena_delete(mpc_ast_arena_t *a) {
+  int j;
+  mpc_arena_chunk_t *c = a->chunks;
+  a->root = NULL;
+  for (j = 0; j < a->foreign_num; j++) { mpc_ast_delete(a->foreign[j]); }
+  free(a->foreign);
+  while (c) {
+    mpc_arena_chunk_t *n = c->next;
+    free(c);
+    c = n;
+  }
+  free(a);
+}
 
 typedef struct {
 
@@ -83,6 +212,9 @@ typedef struct {
 
   char *string;
   char *buffer;
+  long buffer_pos;
+  size_t buffer_len;
+  size_t buffer_cap;
   FILE *file;
 
   int suppress;
@@ -94,12 +226,67 @@ typedef struct {
   char *lasts;
   char last;
 
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  size_t mapped;
+  int borrowed;
+  int regex;
+  int span;
+
+  int lazy;
+  long err_floor;
+  long err_furthest;
+  int depth_hit;
+
+  mpc_arena_chunk_t *arena;
+  size_t arena_size;
+  char *arena_ptr;
+  char *arena_end;
+  void *arena_free[MPC_ARENA_CLASSES];
+
+  mpc_memo_t *memo;
+  int memo_slots;
+  int memo_num;
+  long memo_taint;
+
+  mpc_ast_arena_t *ast;
 
 } mpc_input_t;
 
+static void mpc_arena_init(mpc_input_t *i) {
+  i->arena = NULL;
+  i->arena_size = 0;
+  i->arena_ptr = NULL;
+  i->arena_end = NULL;
+  memset(i->arena_free, 0, sizeof(i->arena_free));
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_taint = 0;
+  i->ast = NULL;
+  i->mapped = 0;
+  i->borrowed = 0;
+  i->regex = 0;
+  i->span = 0;
+  i->lazy = 0;
+  i->err_floor = 0;
+  i->err_furthest = -1;
+  i->depth_hit = 0;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_cap = 0;
+}
+
+static void mpc_arena_delete(mpc_input_t *i) {
+  mpc_arena_chunk_t *c = i->arena;
+  while (c) {
+    mpc_arena_chunk_t *n = c->next;
+    free(c);
+    c = n;
+  }
+}
+
+static void mpc_memo_delete(mpc_input_t *i);
+static void mpc_input_buffer_unread(mpc_input_t *i);
+
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -123,8 +310,7 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_arena_init(i);
 
   return i;
 }
@@ -153,11 +339,28 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_arena_init(i);
+
+  return i;
+
+}
 
+/* Parses a mapping from mpc_map_file in place; the input takes ownership of it. */
+static mpc_input_t *mpc_input_new_mapped(const char *filename, char *string, size_t length) {
+  mpc_input_t *i = mpc_input_new_nstring(filename, "", 0);
+  free(i->string);
+  i->string = string;
+  i->mapped = length + 1;
   return i;
+}
 
+/* Parses a NUL-terminated string in place; the caller keeps ownership of it. */
+static mpc_input_t *mpc_input_new_borrowed(const char *filename, const char *string) {
+  mpc_input_t *i = mpc_input_new_nstring(filename, "", 0);
+  free(i->string);
+  i->string = (char *)string;
+  i->borrowed = 1;
+  return i;
 }
 
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
@@ -182,8 +385,7 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_arena_init(i);
 
   return i;
 
@@ -210,8 +412,7 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_arena_init(i);
 
   return i;
 }
@@ -220,38 +421,73 @@ static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
 
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  if (i->type == MPC_INPUT_STRING && i->mapped) { mpc_unmap_file(i->string, i->mapped - 1); }
+  else if (i->type == MPC_INPUT_STRING && !i->borrowed) { free(i->string); }
+  if (i->type == MPC_INPUT_PIPE) { mpc_input_buffer_unread(i); }
 
   free(i->marks);
   free(i->lasts);
+  mpc_memo_delete(i);
+  mpc_arena_delete(i);
   free(i);
 }
 
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+  mpc_arena_chunk_t *c;
+  for (c = i->arena; c != NULL; c = c->next) {
+    if ((char*)p > (char*)c && (char*)p < c->end) { return 1; }
+  }
+  return 0;
+}
+
+/* Each block is preceded by its size class. */
+static size_t mpc_mem_class(size_t n) {
+  size_t k = 0;
+  while (((size_t)MPC_ARENA_CLASS_MIN << k) < n) { k++; }
+  return k;
+}
+
+static size_t mpc_mem_size(void *p) {
+  return (size_t)MPC_ARENA_CLASS_MIN << ((size_t*)p)[-1];
+}
+
+static void mpc_arena_grow(mpc_input_t *i, size_t n) {
+  mpc_arena_chunk_t *c;
+  size_t size = i->arena_size ? i->arena_size * 2 : MPC_ARENA_CHUNK_MIN;
+  if (size < n) { size = n; }
+  c = malloc(sizeof(mpc_arena_chunk_t) + size);
+  c->next = i->arena;
+  c->end = (char*)(c + 1) + size;
+  i->arena = c;
+  i->arena_size = size;
+  i->arena_ptr = (char*)(c + 1);
+  i->arena_end = c->end;
+}
+
+static void *mpc_arena_bump(mpc_input_t *i, size_t n) {
+  char *p;
+  if ((size_t)(i->arena_end - i->arena_ptr) < n) { mpc_arena_grow(i, n); }
+  p = i->arena_ptr;
+  i->arena_ptr += n;
+  return p;
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
+  size_t k;
   char *p;
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  if (n > MPC_ARENA_MAX) { return malloc(n); }
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  k = mpc_mem_class(n);
+  if (i->arena_free[k]) {
+    p = i->arena_free[k];
+    i->arena_free[k] = *(void**)p;
+    return p;
+  }
 
-  return malloc(n);
+  p = mpc_arena_bump(i, sizeof(size_t) + ((size_t)MPC_ARENA_CLASS_MIN << k));
+  *(size_t*)p = k;
+  return p + sizeof(size_t);
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -261,33 +497,36 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
+  size_t k;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  k = ((size_t*)p)[-1];
+  *(void**)p = i->arena_free[k];
+  i->arena_free[k] = p;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
   char *q = NULL;
+  size_t m;
 
   if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
 
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
-    return q;
-  }
+  m = mpc_mem_size(p);
+  if (n <= m) { return p; }
 
-  return p;
+  q = mpc_malloc(i, n);
+  memcpy(q, p, m);
+  mpc_free(i, p);
+  return q;
 }
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
+  size_t m;
   if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
+  m = mpc_mem_size(p);
+  q = malloc(m);
+  memcpy(q, p, m);
   mpc_free(i, p);
   return q;
 }
@@ -313,14 +552,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -335,14 +569,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
@@ -359,12 +585,57 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+/*
+** Makes sure the character at the current position of a
+** pipe is in the buffer, reading it if needed. Before the
+** buffer grows, characters no mark can rewind to are
+** dropped from its front, which keeps every character
+** read and moved only a constant number of times overall.
+*/
+
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+
+  int c;
+  long keep;
+  size_t dead;
+
+  if (i->state.pos < i->buffer_pos + (long)i->buffer_len) { return 1; }
+
+  c = getc(i->file);
+  if (c == EOF) { return 0; }
+
+  if (i->buffer_len == i->buffer_cap) {
+
+    keep = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+    dead = (size_t)(keep - i->buffer_pos);
+    if (dead > 0) {
+      memmove(i->buffer, i->buffer + dead, i->buffer_len - dead);
+      i->buffer_pos = keep;
+      i->buffer_len -= dead;
+    }
+
+    if (i->buffer_len * 2 > i->buffer_cap || i->buffer_cap == 0) {
+      i->buffer_cap = i->buffer_cap ? i->buffer_cap * 2 : MPC_INPUT_BUFFER_MIN;
+      i->buffer = realloc(i->buffer, i->buffer_cap);
+    }
+  }
+
+  i->buffer[i->buffer_len++] = (char)c;
+  return 1;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  if (!mpc_input_buffer_fill(i)) { return '\0'; }
+  return i->buffer[i->state.pos - i->buffer_pos];
+}
+
+/* Hands characters read ahead of the final position back to the pipe. */
+static void mpc_input_buffer_unread(mpc_input_t *i) {
+  long j;
+  for (j = i->buffer_pos + (long)i->buffer_len - 1; j >= i->state.pos; j--) {
+    ungetc(i->buffer[j - i->buffer_pos], i->file);
+  }
+  free(i->buffer);
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
@@ -375,17 +646,7 @@ static char mpc_input_getc(mpc_input_t *i) {
 
     case MPC_INPUT_STRING: return i->string[i->state.pos];
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
 
     default: return c;
   }
@@ -405,23 +666,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
       fseek(i->file, -1, SEEK_CUR);
       return c;
 
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
 
     default: return c;
   }
@@ -437,30 +682,14 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
   switch (i->type) {
     case MPC_INPUT_STRING: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
     default: { break; }
   }
+  (void) c;
   return 0;
 }
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -535,8 +764,10 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
 
-  *o = mpc_malloc(i, strlen(c) + 1);
-  strcpy(*o, c);
+  if (o) {
+    *o = mpc_malloc(i, strlen(c) + 1);
+    strcpy(*o, c);
+  }
   return 1;
 }
 
@@ -562,6 +793,158 @@ static int mpc_input_eoi(mpc_input_t* i, char **o) {
   }
 }
 
+/*
+** Compiled regular expressions. Regexes built by mpc_re are
+** also compiled to a tree of byte-class tables, matched by
+** mpc_input_regex directly against a string input with no
+** marks and no allocations until the match is returned.
+**
+** mpc regexes are PEG-like: alternatives are ordered and
+** repetition is possessive, so a textbook DFA would accept
+** different strings (for example `[a-z]*a`). The compiled
+** form keeps those semantics and is only built for regexes
+** whose every construct it supports.
+*/
+
+enum {
+  MPC_RE_CLASS,
+  MPC_RE_SPAN,
+  MPC_RE_SPAN1,
+  MPC_RE_STRING,
+  MPC_RE_EMPTY,
+  MPC_RE_SOI,
+  MPC_RE_EOI,
+  MPC_RE_ANCHOR,
+  MPC_RE_AND,
+  MPC_RE_OR,
+  MPC_RE_MANY,
+  MPC_RE_MANY1,
+  MPC_RE_MAYBE,
+  MPC_RE_NOT
+};
+
+typedef struct mpc_re_node_t {
+  int type;
+  int width0;
+  int n;
+  struct mpc_re_node_t **xs;
+  unsigned char set[256];
+  char *str;
+  int(*f)(char,char);
+} mpc_re_node_t;
+
+typedef struct {
+  long pos;
+  int term;
+} mpc_re_state_t;
+
+static int mpc_re_match(const mpc_re_node_t *x, const unsigned char *s, long start, char last, mpc_re_state_t *st) {
+
+  int j;
+  const char *c;
+  char prev;
+  mpc_re_state_t save;
+
+  switch (x->type) {
+
+    case MPC_RE_CLASS:
+      if (!x->set[s[st->pos]]) { return 0; }
+      st->pos++;
+      return 1;
+
+    case MPC_RE_SPAN1:
+      if (!x->set[s[st->pos]]) { return 0; }
+      st->pos++;
+      /* fall through */
+
+    case MPC_RE_SPAN:
+      while (x->set[s[st->pos]]) { st->pos++; }
+      return 1;
+
+    case MPC_RE_STRING:
+      for (c = x->str, j = 0; *c; c++, j++) {
+        if (s[st->pos + j] != (unsigned char)*c) { return 0; }
+      }
+      st->pos += j;
+      return 1;
+
+    case MPC_RE_EMPTY: return 1;
+
+    case MPC_RE_SOI:
+    case MPC_RE_ANCHOR:
+      prev = st->pos > start ? (char)s[st->pos-1] : last;
+      return x->type == MPC_RE_SOI ? prev == '\0' : x->f(prev, (char)s[st->pos]);
+
+    case MPC_RE_EOI:
+      if (st->term || s[st->pos] != '\0') { return 0; }
+      st->term = 1;
+      return 1;
+
+    case MPC_RE_AND:
+      save = *st;
+      for (j = 0; j < x->n; j++) {
+        if (!mpc_re_match(x->xs[j], s, start, last, st)) { *st = save; return 0; }
+      }
+      return 1;
+
+    case MPC_RE_OR:
+      for (j = 0; j < x->n; j++) {
+        if (mpc_re_match(x->xs[j], s, start, last, st)) { return 1; }
+      }
+      return 0;
+
+    case MPC_RE_MANY1:
+      if (!mpc_re_match(x->xs[0], s, start, last, st)) { return 0; }
+      /* fall through */
+
+    case MPC_RE_MANY:
+      while (mpc_re_match(x->xs[0], s, start, last, st));
+      return 1;
+
+    case MPC_RE_MAYBE:
+      mpc_re_match(x->xs[0], s, start, last, st);
+      return 1;
+
+    case MPC_RE_NOT:
+      save = *st;
+      if (mpc_re_match(x->xs[0], s, start, last, st)) { *st = save; return 0; }
+      return 1;
+
+    default: return 0;
+  }
+}
+
+static int mpc_input_regex(mpc_input_t *i, const mpc_re_node_t *x, char **o) {
+
+  long j;
+  const unsigned char *s = (const unsigned char*)i->string;
+  mpc_re_state_t st;
+
+  st.pos = i->state.pos;
+  st.term = i->state.term;
+
+  if (!mpc_re_match(x, s, i->state.pos, i->last, &st)) { return 0; }
+
+  if (o) {
+    *o = mpc_malloc(i, st.pos - i->state.pos + 1);
+    memcpy(*o, s + i->state.pos, st.pos - i->state.pos);
+    (*o)[st.pos - i->state.pos] = '\0';
+  }
+
+  for (j = i->state.pos; j < st.pos; j++) {
+    i->state.col++;
+    if (s[j] == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
+  }
+
+  if (st.pos > i->state.pos) { i->last = (char)s[st.pos-1]; }
+  i->state.pos = st.pos;
+  i->state.term = st.term;
+  return 1;
+}
+
 static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   mpc_state_t *r = mpc_malloc(i, sizeof(mpc_state_t));
   memcpy(r, &i->state, sizeof(mpc_state_t));
@@ -728,6 +1111,26 @@ static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   return mpc_export(i, x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = mpc_malloc(i, sizeof(mpc_err_t));
+  *y = *x;
+  y->filename = mpc_malloc(i, strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->expected = x->expected_num ? mpc_malloc(i, sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  if (x->failure) {
+    y->failure = mpc_malloc(i, strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   int j;
   (void)i;
@@ -916,7 +1319,9 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_REGEX      = 29
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -933,9 +1338,28 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_p
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; char *e; } mpc_pdata_check_with_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
-typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+
+/*
+** Jump table of a choice, built by the grammar analysis of
+** `mpca_lang`. Row 0 gives the first alternative that can
+** match when the input continues with a given byte, and row
+** `j+1` the next one after alternative `j`. A value of `n`
+** means no alternative is left. Repetitions get the table
+** of a choice between their child and stopping. Tables built
+** before an analysed rule is undefined are out of date.
+*/
+
+typedef struct {
+  long gen;
+  unsigned char next[][256];
+} mpc_jump_t;
+
+static long mpc_jump_gen = 0;
+
+typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; mpc_jump_t *jump; } mpc_pdata_repeat_t;
+typedef struct { int n; mpc_parser_t **xs; mpc_jump_t *jump; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_re_node_t *prog; int height; } mpc_pdata_regex_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -955,6 +1379,7 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_regex_t regex;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -962,6 +1387,26 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char span;
+  char analysed;
+  char ast;
+  int rule;
+  mpc_copy_t memo_copy;
+  mpc_dtor_t memo_dtor;
+  mpc_memo_stats_t memo;
+};
+
+/*
+** Parsers whose output is always exactly the text they
+** consume. TEXT parsers already return it as one string.
+** FOLD parsers build it from their children with `strfold`
+** so on string inputs they are run in span mode instead.
+*/
+
+enum {
+  MPC_SPAN_NONE,
+  MPC_SPAN_TEXT,
+  MPC_SPAN_FOLD
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -976,11 +1421,18 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t l, m;
+  if (i->span) { return NULL; }
   if (n == 0) { return mpc_calloc(i, 1, 1); }
-  for (j = 0; j < n; j++) { l += strlen(xs[j]); }
-  xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  l = strlen(xs[0]);
+  for (j = 1, m = l; j < n; j++) { m += strlen(xs[j]); }
+  xs[0] = mpc_realloc(i, xs[0], m + 1);
+  for (j = 1; j < n; j++) {
+    m = strlen(xs[j]);
+    memcpy((char*)xs[0] + l, xs[j], m + 1);
+    l += m;
+    mpc_free(i, xs[j]);
+  }
   return xs[0];
 }
 
@@ -1013,8 +1465,11 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
   return NULL;
 }
 
+static mpc_ast_t *mpc_ast_new_in(mpc_ast_arena_t *arena, const char *tag, const char *contents);
+static mpc_ast_t *mpc_ast_copy_in(mpc_ast_arena_t *arena, mpc_ast_t *a);
+
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = mpc_ast_new_in(i->ast, "", c);
   mpc_free(i, c);
   return a;
 }
@@ -1038,285 +1493,723 @@ enum {
   MPC_PARSE_STACK_MIN = 4
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+/*
+** Nesting depth at which parsing fails with an error instead
+** of exhausting memory, set with mpc_set_max_depth.
+*/
 
+#ifndef MPC_MAX_RECURSION_DEPTH
 #define MPC_MAX_RECURSION_DEPTH 1000
+#endif
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+static int mpc_depth_limit = MPC_MAX_RECURSION_DEPTH;
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+int mpc_set_max_depth(int depth) {
+  int old = mpc_depth_limit;
+  mpc_depth_limit = depth > 0 ? depth : 0;
+  return old;
+}
 
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+/*
+** Packrat Memoization
+*/
+
+static size_t mpc_memo_hash(mpc_parser_t *p, long pos, int suppress) {
+  size_t h = ((size_t)p >> 4) ^ ((size_t)pos * 2654435761u) ^ (size_t)suppress;
+  return h ^ (h >> 16);
+}
+
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p, long pos, int suppress) {
+  int j;
+  size_t h;
+  mpc_memo_t *m;
+
+  if (i->memo == NULL) { return NULL; }
+
+  h = mpc_memo_hash(p, pos, suppress);
+  for (j = 0; j < MPC_MEMO_PROBE; j++) {
+    m = &i->memo[(h + j) & (i->memo_slots - 1)];
+    if (m->p == NULL) { return NULL; }
+    if (m->p == p && m->pos == pos && m->suppress == suppress) { return m; }
+  }
+  return NULL;
+}
+
+static void mpc_memo_clear(mpc_input_t *i, mpc_memo_t *m) {
+  if (m->ok) {
+    m->p->memo_dtor(m->result.output);
+  } else {
+    mpc_err_delete_internal(i, m->result.error);
+  }
+  mpc_err_delete_internal(i, m->merged);
+  m->p = NULL;
+}
+
+static void mpc_memo_delete(mpc_input_t *i) {
+  int j;
+  for (j = 0; j < i->memo_slots; j++) {
+    if (i->memo[j].p) { mpc_memo_clear(i, &i->memo[j]); }
+  }
+}
+
+static void mpc_memo_reset(mpc_input_t *i) {
+  mpc_memo_delete(i);
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+}
+
+/* Results stored and replayed while building into an arena are copied within it. */
+static mpc_val_t *mpc_memo_copy(mpc_input_t *i, mpc_parser_t *p, mpc_val_t *x) {
+  if (i->ast && p->memo_copy == (mpc_copy_t)mpc_ast_copy) { return mpc_ast_copy_in(i->ast, x); }
+  return p->memo_copy(x);
+}
+
+/* Returns an empty slot for the key, evicting the home slot if the probe window is full. */
+static mpc_memo_t *mpc_memo_place(mpc_input_t *i, mpc_parser_t *p, long pos, int suppress) {
+  int j;
+  size_t h = mpc_memo_hash(p, pos, suppress);
+  mpc_memo_t *m;
+
+  for (j = 0; j < MPC_MEMO_PROBE; j++) {
+    m = &i->memo[(h + j) & (i->memo_slots - 1)];
+    if (m->p == NULL) { i->memo_num++; return m; }
+  }
+
+  m = &i->memo[h & (i->memo_slots - 1)];
+  mpc_memo_clear(i, m);
+  return m;
+}
+
+static void mpc_memo_grow(mpc_input_t *i) {
+
+  int j;
+  int slots = i->memo_slots;
+  mpc_memo_t *old = i->memo;
+  mpc_memo_t *m;
+
+  i->memo_slots = slots ? slots * 2 : MPC_MEMO_MIN;
+  i->memo = mpc_arena_bump(i, sizeof(mpc_memo_t) * i->memo_slots);
+  memset(i->memo, 0, sizeof(mpc_memo_t) * i->memo_slots);
+  i->memo_num = 0;
+
+  for (j = 0; j < slots; j++) {
+    if (old[j].p == NULL) { continue; }
+    m = mpc_memo_place(i, old[j].p, old[j].pos, old[j].suppress);
+    *m = old[j];
   }
+}
+
+static mpc_memo_t *mpc_memo_slot(mpc_input_t *i, mpc_parser_t *p, long pos, int suppress) {
+  if (i->memo_num * 2 >= i->memo_slots && i->memo_slots < MPC_MEMO_MAX) {
+    mpc_memo_grow(i);
+  }
+  return mpc_memo_place(i, p, pos, suppress);
+}
+
+/*
+** The parser runs on an explicit stack of frames rather
+** than the C stack, so deeply nested input is limited only
+** by the configurable depth limit and by memory. Every
+** child parser gets a frame of its own; the parent frame
+** records the stage to resume at and continues once the
+** child has left its result in x and ret. The first
+** frames live on the C stack and the rest are allocated
+** only when the nesting gets deeper.
+*/
+
+enum {
+  MPC_PARSE_FRAMES_MIN = 64
+};
+
+enum {
+  MPC_STAGE_RUN,    /* depth limit, memoization and span dispatch */
+  MPC_STAGE_STEP,   /* the parser itself */
+  MPC_STAGE_MEMO,   /* after a memoized step */
+  MPC_STAGE_SPAN,   /* after a span step */
+  /* after a child of the parser type of the same name */
+  MPC_STAGE_APPLY,
+  MPC_STAGE_APPLY_TO,
+  MPC_STAGE_CHECK,
+  MPC_STAGE_CHECK_WITH,
+  MPC_STAGE_EXPECT,
+  MPC_STAGE_PREDICT,
+  MPC_STAGE_NOT,
+  MPC_STAGE_MAYBE,
+  MPC_STAGE_MANY,
+  MPC_STAGE_COUNT,
+  MPC_STAGE_OR,
+  MPC_STAGE_AND
+};
+
+typedef struct {
+  mpc_parser_t *p;
+  int stage;
+  int depth;
+  int err;                 /* frame collecting merged errors, -1 for the caller */
+  int j, k;
+  int slots;
+  long pos;
+  long taint;
+  int suppress;
+  mpc_err_t *merged;
+  mpc_result_t *results;   /* NULL while results_stk is in use */
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+} mpc_frame_t;
+
+static mpc_frame_t *mpc_parse_grow(mpc_frame_t *frames, mpc_frame_t *frames_stk, int num, int slots) {
+  mpc_frame_t *grown;
+  if (frames != frames_stk) { return realloc(frames, sizeof(mpc_frame_t) * slots); }
+  grown = malloc(sizeof(mpc_frame_t) * slots);
+  memcpy(grown, frames_stk, sizeof(mpc_frame_t) * num);
+  return grown;
+}
+
+#define MPC_PUSH(c, stg, d, e) { \
+  mpc_parser_t *pc = (c); \
+  int pd = (d), pe = (e); \
+  if (num == slots) { slots *= 2; frames = mpc_parse_grow(frames, frames_stk, num, slots); } \
+  f = &frames[num++]; \
+  f->p = pc; f->stage = stg; f->depth = pd; f->err = pe; }
+
+/*
+** Failed parsers only build an error when it can reach the
+** reported one. A lazy run records just the furthest offset
+** at which an error would have been built; if the parse
+** fails it is run again building errors from that offset
+** on, since the merge discards any before it in favour of
+** the furthest.
+*/
+
+static int mpc_err_skip(mpc_input_t *i) {
+  if (i->state.pos < i->err_floor) { return 1; }
+  if (!i->lazy) { return 0; }
+  if (!i->suppress && i->state.pos > i->err_furthest) { i->err_furthest = i->state.pos; }
+  return 1;
+}
+
+/*
+** Choices and repetitions with a jump table skip the parsers
+** that cannot match the next byte. A skipped parser would
+** only have failed without consuming anything, so this is
+** done while no errors are built, and on strings where
+** peeking is free.
+*/
+
+static mpc_jump_t *mpc_jump(mpc_input_t *i, mpc_jump_t *t) {
+  return t && t->gen == mpc_jump_gen && i->lazy && i->type == MPC_INPUT_STRING ? t : NULL;
+}
+
+#define MPC_NEXT_BYTE ((unsigned char)i->string[i->state.pos])
+#define MPC_REPEAT_STOP ((t = mpc_jump(i, p->data.repeat.jump)) && t->next[0][MPC_NEXT_BYTE])
+
+/*
+** Leaf parsers are run directly instead of through a frame
+** of their own. Returns -1 when the parser is not a leaf or
+** needs the depth, memoization or span handling of a frame.
+*/
+
+static int mpc_parse_leaf(mpc_input_t *i, mpc_parser_t *p, int depth, mpc_result_t *r) {
+
+  char **o = i->span ? NULL : (char**)&r->output;
+  int x;
+
+  if (p->memo_copy || p->span == MPC_SPAN_FOLD || (mpc_depth_limit > 0 && depth >= mpc_depth_limit)) { return -1; }
 
   switch (p->type) {
+    case MPC_TYPE_PASS:    r->output = NULL; return 1;
+    case MPC_TYPE_ANY:     x = mpc_input_any(i, o); break;
+    case MPC_TYPE_SINGLE:  x = mpc_input_char(i, p->data.single.x, o); break;
+    case MPC_TYPE_RANGE:   x = mpc_input_range(i, p->data.range.x, p->data.range.y, o); break;
+    case MPC_TYPE_ONEOF:   x = mpc_input_oneof(i, p->data.string.x, o); break;
+    case MPC_TYPE_NONEOF:  x = mpc_input_noneof(i, p->data.string.x, o); break;
+    case MPC_TYPE_SATISFY: x = mpc_input_satisfy(i, p->data.satisfy.f, o); break;
+    case MPC_TYPE_STRING:  x = mpc_input_string(i, p->data.string.x, o); break;
+    case MPC_TYPE_REGEX:
+      if (!i->regex || i->backtrack <= 0
+      ||  (mpc_depth_limit > 0 && depth + p->data.regex.height > mpc_depth_limit)) { return -1; }
+      x = mpc_input_regex(i, p->data.regex.prog, o);
+      break;
+    default: return -1;
+  }
 
-    /* Basic Parsers */
-
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
-
-    /* Other parsers */
-
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
-
-    /* Application Parsers */
-
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+  if (x) { if (i->span) { r->output = NULL; } }
+  else { r->error = NULL; }
+  return x;
+}
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+#define MPC_ERROR(x) (mpc_err_skip(i) ? NULL : (x))
+#define MPC_LEAF(c) ((c)->type == MPC_TYPE_PASS || ((c)->type >= MPC_TYPE_ANY && (c)->type <= MPC_TYPE_STRING) || (c)->type == MPC_TYPE_REGEX)
+#define MPC_MERGE(x) { \
+  mpc_err_t **fe = f->err < 0 ? e : &frames[f->err].merged; \
+  *fe = mpc_err_merge(i, *fe, x); }
+#define MPC_RESULTS(f) ((f)->results ? (f)->results : (f)->results_stk)
+#define MPC_RESULTS_FREE(f) if ((f)->results) { mpc_free(i, (f)->results); }
+
+#define MPC_CALL(c, stg) \
+  f->stage = stg; \
+  if (!MPC_LEAF(c) || (x = mpc_parse_leaf(i, c, f->depth+1, &ret)) < 0) { \
+    MPC_PUSH(c, MPC_STAGE_RUN, f->depth+1, f->err); \
+  } \
+  continue
+#define MPC_SUCCESS(v) ret.output = v; x = 1; num--; continue
+#define MPC_FAILURE(v) ret.error = v; x = 0; num--; continue
+#define MPC_PRIMITIVE(y) \
+  if (y) { MPC_SUCCESS(i->span ? NULL : ret.output); } \
+  else { MPC_FAILURE(NULL); }
+#define MPC_OUTPUT (i->span ? NULL : (char**)&ret.output)
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+
+  mpc_frame_t frames_stk[MPC_PARSE_FRAMES_MIN];
+  mpc_frame_t *frames = frames_stk;
+  mpc_frame_t *f;
+  int num = 0;
+  int slots = MPC_PARSE_FRAMES_MIN;
+  mpc_result_t *results;
+  mpc_result_t ret;
+  mpc_memo_t *m;
+  mpc_jump_t *t;
+  size_t n;
+  int x = 0;
+
+  ret.output = NULL;
+
+  MPC_PUSH(p, MPC_STAGE_RUN, 0, -1);
+
+  while (num > 0) {
+
+    f = &frames[num-1];
+    p = f->p;
+
+    switch (f->stage) {
+
+    case MPC_STAGE_RUN:
+
+      if (mpc_depth_limit > 0 && f->depth >= mpc_depth_limit) {
+        i->memo_taint++;
+        i->depth_hit = 1;
+        MPC_FAILURE(MPC_ERROR(mpc_err_fail(i, "Maximum recursion depth exceeded!")));
       }
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
+      /*
+      ** Runs a memoized parser, or replays its earlier result at
+      ** this offset. The errors it merges into the furthest error
+      ** are collected separately so a replay can merge them again.
+      */
+
+      if (p->memo_copy && i->backtrack > 0 && i->type != MPC_INPUT_PIPE && !i->span) {
+
+        f->pos = i->state.pos;
+        f->taint = i->memo_taint;
+        f->suppress = i->suppress > 0;
+        f->merged = NULL;
+
+        p->memo.lookups++;
+
+        m = mpc_memo_find(i, p, f->pos, f->suppress);
+        if (m) {
+          p->memo.hits++;
+          if (m->merged) { MPC_MERGE(mpc_err_copy(i, m->merged)); }
+          i->state = m->end;
+          i->last = m->last;
+          if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+          if (m->ok) {
+            MPC_SUCCESS(mpc_memo_copy(i, p, m->result.output));
+          } else {
+            MPC_FAILURE(mpc_err_copy(i, m->result.error));
+          }
         }
-      } else {
-        MPC_FAILURE(r->error);
-      }
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+        f->stage = MPC_STAGE_MEMO;
+        MPC_PUSH(p, MPC_STAGE_STEP, f->depth, num-1);
+        continue;
       }
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
+      /*
+      ** Runs a parser whose output is just the text it consumes
+      ** without building any of the intermediate strings, then
+      ** copies the whole match out of the input in one go. This
+      ** relies on failures consuming nothing, so it is only done
+      ** while backtracking is enabled.
+      */
+
+      if (p->span == MPC_SPAN_FOLD && !i->span && i->backtrack > 0 && i->type == MPC_INPUT_STRING) {
+        f->pos = i->state.pos;
+        i->span++;
+        f->stage = MPC_STAGE_SPAN;
+        MPC_PUSH(p, MPC_STAGE_STEP, f->depth, f->err);
+        continue;
       }
 
-    /* Optional Parsers */
+      f->stage = MPC_STAGE_STEP;
+      /* fallthrough */
 
-    /* TODO: Update Not Error Message */
+    case MPC_STAGE_STEP:
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+      switch (p->type) {
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+        /* Basic Parsers */
 
-    /* Repeat Parsers */
+        case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, MPC_OUTPUT));
+        case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, MPC_OUTPUT));
+        case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, MPC_OUTPUT));
+        case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, MPC_OUTPUT));
+        case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, MPC_OUTPUT));
+        case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, MPC_OUTPUT));
+        case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, MPC_OUTPUT));
+        case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&ret.output));
+        case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&ret.output));
+        case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&ret.output));
 
-    case MPC_TYPE_MANY:
+        /* The compiled form is used only where the combinators could not hit the depth limit. */
+        case MPC_TYPE_REGEX:
+          if (i->regex && i->backtrack > 0
+          &&  (mpc_depth_limit <= 0 || f->depth + p->data.regex.height <= mpc_depth_limit)) {
+            MPC_PRIMITIVE(mpc_input_regex(i, p->data.regex.prog, MPC_OUTPUT));
+          }
+          f->p = p->data.regex.x;
+          f->stage = MPC_STAGE_RUN;
+          continue;
+
+        /* Other parsers */
+
+        case MPC_TYPE_UNDEFINED: MPC_FAILURE(MPC_ERROR(mpc_err_fail(i, "Parser Undefined!")));
+        case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+        case MPC_TYPE_FAIL:      MPC_FAILURE(MPC_ERROR(mpc_err_fail(i, p->data.fail.m)));
+        case MPC_TYPE_LIFT:      MPC_SUCCESS(i->span ? NULL : p->data.lift.lf());
+        case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+        case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+
+        /* Application Parsers */
+
+        case MPC_TYPE_APPLY:      MPC_CALL(p->data.apply.x, MPC_STAGE_APPLY);
+        case MPC_TYPE_APPLY_TO:   MPC_CALL(p->data.apply_to.x, MPC_STAGE_APPLY_TO);
+        case MPC_TYPE_CHECK:      MPC_CALL(p->data.check.x, MPC_STAGE_CHECK);
+        case MPC_TYPE_CHECK_WITH: MPC_CALL(p->data.check_with.x, MPC_STAGE_CHECK_WITH);
+
+        case MPC_TYPE_EXPECT:
+          mpc_input_suppress_enable(i);
+          MPC_CALL(p->data.expect.x, MPC_STAGE_EXPECT);
+
+        case MPC_TYPE_PREDICT:
+          mpc_input_backtrack_disable(i);
+          MPC_CALL(p->data.predict.x, MPC_STAGE_PREDICT);
+
+        /* Optional Parsers */
+
+        case MPC_TYPE_NOT:
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          MPC_CALL(p->data.not.x, MPC_STAGE_NOT);
+
+        case MPC_TYPE_MAYBE: MPC_CALL(p->data.not.x, MPC_STAGE_MAYBE);
+
+        /* Repeat Parsers */
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+          f->j = 0;
+          f->k = 0;
+          f->slots = MPC_PARSE_STACK_MIN;
+          f->results = NULL;
+          if (MPC_REPEAT_STOP) { f->stage = MPC_STAGE_MANY; x = 0; ret.error = NULL; continue; }
+          MPC_CALL(p->data.repeat.x, MPC_STAGE_MANY);
+
+        case MPC_TYPE_COUNT:
+          f->j = 0;
+          f->results = p->data.repeat.n > MPC_PARSE_STACK_MIN
+            ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n) : NULL;
+          MPC_CALL(p->data.repeat.x, MPC_STAGE_COUNT);
+
+        /* Combinatory Parsers */
+
+        case MPC_TYPE_OR:
+          if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+          t = mpc_jump(i, p->data.or.jump);
+          f->j = t ? t->next[0][MPC_NEXT_BYTE] : 0;
+          if (f->j == p->data.or.n) { MPC_FAILURE(NULL); }
+          MPC_CALL(p->data.or.xs[f->j], MPC_STAGE_OR);
+
+        case MPC_TYPE_AND:
+          if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+          f->j = 0;
+          f->results = p->data.and.n > MPC_PARSE_STACK_MIN
+            ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.and.n) : NULL;
+          mpc_input_mark(i);
+          MPC_CALL(p->data.and.xs[0], MPC_STAGE_AND);
+
+        /* End */
+
+        default:
+          MPC_FAILURE(MPC_ERROR(mpc_err_fail(i, "Unknown Parser Type Id!")));
+      }
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+    case MPC_STAGE_MEMO:
+
+      /* Results cut short by the recursion limit depend on depth, not just offset. */
+      if (i->memo_taint == f->taint) {
+        m = mpc_memo_slot(i, p, f->pos, f->suppress);
+        m->p = p;
+        m->pos = f->pos;
+        m->suppress = f->suppress;
+        m->ok = x;
+        m->end = i->state;
+        m->last = i->last;
+        m->merged = mpc_err_copy(i, f->merged);
+        if (x) {
+          m->result.output = mpc_memo_copy(i, p, ret.output);
+        } else {
+          m->result.error = mpc_err_copy(i, ret.error);
         }
+        p->memo.stores++;
       }
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+      if (f->merged) { MPC_MERGE(f->merged); }
+      num--;
+      continue;
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    case MPC_STAGE_SPAN:
 
-    case MPC_TYPE_MANY1:
+      i->span--;
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
+      if (x) {
+        n = i->state.pos - f->pos;
+        ret.output = mpc_malloc(i, n + 1);
+        memcpy(ret.output, i->string + f->pos, n);
+        ((char*)ret.output)[n] = '\0';
       }
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+      num--;
+      continue;
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+    case MPC_STAGE_APPLY:
+      if (x) { MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, ret.output)); }
+      MPC_FAILURE(ret.error);
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+    case MPC_STAGE_APPLY_TO:
+      if (x) { MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, ret.output, p->data.apply_to.d)); }
+      MPC_FAILURE(ret.error);
 
-    case MPC_TYPE_COUNT:
+    case MPC_STAGE_CHECK:
+      if (!x) { MPC_FAILURE(ret.error); }
+      if (p->data.check.f(&ret.output)) { MPC_SUCCESS(ret.output); }
+      mpc_parse_dtor(i, p->data.check.dx, ret.output);
+      MPC_FAILURE(MPC_ERROR(mpc_err_fail(i, p->data.check.e)));
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+    case MPC_STAGE_CHECK_WITH:
+      if (!x) { MPC_FAILURE(ret.error); }
+      if (p->data.check_with.f(&ret.output, p->data.check_with.d)) { MPC_SUCCESS(ret.output); }
+      mpc_parse_dtor(i, p->data.check.dx, ret.output);
+      MPC_FAILURE(MPC_ERROR(mpc_err_fail(i, p->data.check_with.e)));
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
+    case MPC_STAGE_EXPECT:
+      mpc_input_suppress_disable(i);
+      if (x) { MPC_SUCCESS(ret.output); }
+      MPC_FAILURE(MPC_ERROR(mpc_err_new(i, p->data.expect.m)));
+
+    case MPC_STAGE_PREDICT:
+      mpc_input_backtrack_enable(i);
+      if (x) { MPC_SUCCESS(ret.output); }
+      MPC_FAILURE(ret.error);
+
+    /* TODO: Update Not Error Message */
+
+    case MPC_STAGE_NOT:
+      if (x) {
+        mpc_input_rewind(i);
+        mpc_input_suppress_disable(i);
+        mpc_parse_dtor(i, p->data.not.dx, ret.output);
+        MPC_FAILURE(MPC_ERROR(mpc_err_new(i, "opposite")));
       }
+      mpc_input_unmark(i);
+      mpc_input_suppress_disable(i);
+      MPC_SUCCESS(i->span ? NULL : p->data.not.lf());
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+    case MPC_STAGE_MAYBE:
+      if (x) { MPC_SUCCESS(ret.output); }
+      MPC_MERGE(ret.error);
+      MPC_SUCCESS(i->span ? NULL : p->data.not.lf());
+
+    case MPC_STAGE_MANY:
+
+      if (x) {
+        if (i->span) {
+          f->k++;
+        } else {
+          MPC_RESULTS(f)[f->j++] = ret;
+          if (f->j == MPC_PARSE_STACK_MIN) {
+            f->slots = f->j + f->j / 2;
+            f->results = mpc_malloc(i, sizeof(mpc_result_t) * f->slots);
+            memcpy(f->results, f->results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+          } else if (f->j >= f->slots) {
+            f->slots = f->j + f->j / 2;
+            f->results = mpc_realloc(i, f->results, sizeof(mpc_result_t) * f->slots);
+          }
         }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        if (!MPC_REPEAT_STOP) { MPC_CALL(p->data.repeat.x, MPC_STAGE_MANY); }
+        ret.error = NULL;
       }
 
-    /* Combinatory Parsers */
+      if (p->type == MPC_TYPE_MANY1 && f->j == 0 && f->k == 0) {
+        MPC_FAILURE(mpc_err_many1(i, ret.error));
+      }
 
-    case MPC_TYPE_OR:
+      MPC_MERGE(ret.error);
+      results = MPC_RESULTS(f);
+      ret.output = mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)results);
+      MPC_RESULTS_FREE(f);
+      x = 1;
+      num--;
+      continue;
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+    case MPC_STAGE_COUNT:
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      results = MPC_RESULTS(f);
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        }
+      if (x) {
+        results[f->j++] = ret;
+        if (f->j < p->data.repeat.n) { MPC_CALL(p->data.repeat.x, MPC_STAGE_COUNT); }
+        ret.output = mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)results);
+        MPC_RESULTS_FREE(f);
+        x = 1;
+        num--;
+        continue;
       }
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      for (f->k = 0; f->k < f->j; f->k++) {
+        mpc_parse_dtor(i, p->data.repeat.dx, results[f->k].output);
+      }
+      MPC_RESULTS_FREE(f);
+      MPC_FAILURE(ret.error ? mpc_err_count(i, ret.error, p->data.repeat.n) : NULL);
 
-    case MPC_TYPE_AND:
+    case MPC_STAGE_OR:
 
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      if (x) { MPC_SUCCESS(ret.output); }
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      MPC_MERGE(ret.error);
+      t = mpc_jump(i, p->data.or.jump);
+      f->j = t ? t->next[f->j+1][MPC_NEXT_BYTE] : f->j + 1;
+      if (f->j < p->data.or.n) { MPC_CALL(p->data.or.xs[f->j], MPC_STAGE_OR); }
+      MPC_FAILURE(NULL);
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    case MPC_STAGE_AND:
+
+      results = MPC_RESULTS(f);
+
+      if (!x) {
+        mpc_input_rewind(i);
+        for (f->k = 0; f->k < f->j; f->k++) {
+          mpc_parse_dtor(i, p->data.and.dxs[f->k], results[f->k].output);
         }
+        MPC_RESULTS_FREE(f);
+        MPC_FAILURE(ret.error);
       }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-
-    /* End */
 
-    default:
+      results[f->j++] = ret;
+      if (f->j < p->data.and.n) { MPC_CALL(p->data.and.xs[f->j], MPC_STAGE_AND); }
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+      mpc_input_unmark(i);
+      ret.output = mpc_parse_fold(i, p->data.and.f, f->j, (mpc_val_t**)results);
+      MPC_RESULTS_FREE(f);
+      x = 1;
+      num--;
+      continue;
+    }
   }
 
-  return 0;
+  if (frames != frames_stk) { free(frames); }
 
+  *r = ret;
+  return x;
 }
 
+#undef MPC_PUSH
+#undef MPC_NEXT_BYTE
+#undef MPC_REPEAT_STOP
+#undef MPC_LEAF
+#undef MPC_ERROR
+#undef MPC_MERGE
+#undef MPC_RESULTS
+#undef MPC_RESULTS_FREE
+#undef MPC_CALL
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
+/*
+** Inputs that can be rewound are first parsed lazily,
+** without building any errors, and strings also with the
+** compiled regexes, which do not report errors. If that
+** parse fails it is repeated with the regex combinators
+** and errors from the furthest failure on to build the
+** reported error. Pipes build their errors as they go.
+**
+** A parse that fails after reaching the nesting limit
+** reports that instead, since the furthest error merged
+** from the parsers that were cut short would be misleading.
+** Only the first run counts, as the regex combinators of
+** the second one nest deeper than the compiled regexes.
+**
+** Parsing with an `mpca_lang` rule builds its nodes in an
+** arena. Once the memo table no longer refers to them the
+** arena goes to the root of the tree, or is released if the
+** parse failed.
+*/
+
+static void mpc_parse_ast_finish(mpc_input_t *i, mpc_ast_t *a) {
+  mpc_memo_reset(i);
+  if (a && a->arena == i->ast) { i->ast->root = a; }
+  else { mpc_ast_arena_delete(i->ast); }
+  i->ast = NULL;
+}
+
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
+  mpc_state_t state = i->state;
+  char last = i->last;
+  mpc_err_t *e = NULL;
+  i->regex = i->type == MPC_INPUT_STRING;
+  i->lazy = i->type != MPC_INPUT_PIPE;
+  i->err_floor = 0;
+  i->err_furthest = -1;
+  i->depth_hit = 0;
+  i->ast = p->ast ? mpc_ast_arena_new() : NULL;
+  if (!i->lazy) {
+    e = mpc_err_fail(i, "Unknown Error");
+    e->state = mpc_state_invalid();
+  }
+  x = mpc_parse_run(i, p, r, &e);
+  if (!x && i->depth_hit) {
+    mpc_err_delete_internal(i, e);
+    mpc_err_delete_internal(i, r->error);
+    e = NULL;
+    r->error = mpc_err_fail(i, "Maximum recursion depth exceeded!");
+  } else if (!x && i->lazy) {
+    mpc_err_delete_internal(i, e);
+    mpc_err_delete_internal(i, r->error);
+    mpc_memo_reset(i);
+    if (i->ast) {
+      mpc_ast_arena_delete(i->ast);
+      i->ast = mpc_ast_arena_new();
+    }
+    i->state = state;
+    i->last = last;
+    if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+    i->regex = 0;
+    i->lazy = 0;
+    i->err_floor = i->err_furthest;
+    e = mpc_err_fail(i, "Unknown Error");
+    e->state = mpc_state_invalid();
+    x = mpc_parse_run(i, p, r, &e);
+  }
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
   } else {
     r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
   }
+  if (i->ast) { mpc_parse_ast_finish(i, x ? r->output : NULL); }
   return x;
 }
 
@@ -1328,6 +2221,14 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
+int mpc_parse_borrowed(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_borrowed(filename, string);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
@@ -1352,10 +2253,72 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+/*
+** Maps a file read-only so it can be parsed straight out
+** of the page cache. A zeroed anonymous region one byte
+** longer than the file is reserved first and the file is
+** mapped over its start, so the contents are always followed
+** by a '\0' even when the length is a multiple of the page
+** size. Returns NULL if the file cannot be mapped, in which
+** case callers should fall back to reading it.
+*/
+
+char *mpc_map_file(const char *filename, size_t *length) {
+#ifndef _WIN32
+  int fd;
+  struct stat st;
+  char *s;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) { return NULL; }
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { close(fd); return NULL; }
+
+  s = mmap(NULL, (size_t)st.st_size + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (s == MAP_FAILED) { close(fd); return NULL; }
+
+  if (st.st_size > 0
+  &&  mmap(s, (size_t)st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(s, (size_t)st.st_size + 1);
+    close(fd);
+    return NULL;
+  }
+
+  close(fd);
+  madvise(s, (size_t)st.st_size + 1, MADV_SEQUENTIAL);
+  *length = (size_t)st.st_size;
+  return s;
+#else
+  (void)filename;
+  (void)length;
+  return NULL;
+#endif
+}
+
+void mpc_unmap_file(char *string, size_t length) {
+#ifndef _WIN32
+  munmap(string, length + 1);
+#else
+  (void)string;
+  (void)length;
+#endif
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
-  FILE *f = fopen(filename, "rb");
+  FILE *f;
   int res;
+  size_t length;
+  char *string = mpc_map_file(filename, &length);
+
+  if (string) {
+    mpc_input_t *i = mpc_input_new_mapped(filename, string, length);
+    res = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return res;
+  }
+
+  f = fopen(filename, "rb");
 
   if (f == NULL) {
     r->output = NULL;
@@ -1363,7 +2326,12 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
 
-  res = mpc_parse_file(filename, f, p, r);
+  /* Pipes and terminals cannot be seeked so are read as a pipe. */
+  if (fseek(f, 0, SEEK_CUR) != 0) {
+    res = mpc_parse_pipe(filename, f, p, r);
+  } else {
+    res = mpc_parse_file(filename, f, p, r);
+  }
   fclose(f);
   return res;
 }
@@ -1373,6 +2341,8 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 */
 
 static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static void mpc_re_node_delete(mpc_re_node_t *x);
+static mpc_re_node_t *mpc_re_compile(mpc_parser_t *p, int *height);
 
 static void mpc_undefine_or(mpc_parser_t *p) {
 
@@ -1381,6 +2351,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.jump);
 
 }
 
@@ -1427,6 +2398,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_MANY1:
     case MPC_TYPE_COUNT:
       mpc_undefine_unretained(p->data.repeat.x, 0);
+      free(p->data.repeat.jump);
       break;
 
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
@@ -1442,6 +2414,11 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       free(p->data.check_with.e);
       break;
 
+    case MPC_TYPE_REGEX:
+      mpc_undefine_unretained(p->data.regex.x, 0);
+      mpc_re_node_delete(p->data.regex.prog);
+      break;
+
     default: break;
   }
 
@@ -1452,9 +2429,16 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
 
 }
 
+/* Jump tables built from an analysed rule may no longer hold once it is undefined. */
+static void mpc_jump_invalidate(mpc_parser_t *p) {
+  if (p->analysed) { mpc_jump_gen++; p->analysed = 0; }
+}
+
 void mpc_delete(mpc_parser_t *p) {
   if (p->retained) {
 
+    mpc_jump_invalidate(p);
+
     if (p->type != MPC_TYPE_UNDEFINED) {
       mpc_undefine_unretained(p, 0);
     }
@@ -1479,6 +2463,11 @@ static mpc_parser_t *mpc_undefined(void) {
   return p;
 }
 
+static char mpc_span_join(char a, char b) {
+  if (a == MPC_SPAN_NONE || b == MPC_SPAN_NONE) { return MPC_SPAN_NONE; }
+  return a > b ? a : b;
+}
+
 mpc_parser_t *mpc_new(const char *name) {
   mpc_parser_t *p = mpc_undefined();
   p->retained = 1;
@@ -1497,6 +2486,9 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
   p->retained = a->retained;
   p->type = a->type;
   p->data = a->data;
+  p->span = a->span;
+  p->memo_copy = a->memo_copy;
+  p->memo_dtor = a->memo_dtor;
 
   if (a->name) {
     p->name = malloc(strlen(a->name)+1);
@@ -1535,10 +2527,12 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_MANY:
     case MPC_TYPE_MANY1:
     case MPC_TYPE_COUNT:
+      p->data.repeat.jump = NULL;
       p->data.repeat.x = mpc_copy(a->data.repeat.x);
       break;
 
     case MPC_TYPE_OR:
+      p->data.or.jump = NULL;
       p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
@@ -1566,6 +2560,11 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
 
+    case MPC_TYPE_REGEX:
+      p->data.regex.x    = mpc_copy(a->data.regex.x);
+      p->data.regex.prog = mpc_re_compile(p->data.regex.x, &p->data.regex.height);
+      break;
+
     default: break;
   }
 
@@ -1574,13 +2573,17 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
 }
 
 mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  mpc_jump_invalidate(p);
   mpc_undefine_unretained(p, 1);
   p->type = MPC_TYPE_UNDEFINED;
+  p->ast = 0;
   return p;
 }
 
 mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
 
+  p->ast = 0;
+
   if (p->retained) {
     p->type = a->type;
     p->data = a->data;
@@ -1588,6 +2591,7 @@ mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
     mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
     p->type = a2->type;
     p->data = a2->data;
+    p->span = MPC_SPAN_NONE;
     free(a2);
   }
 
@@ -1609,6 +2613,23 @@ void mpc_cleanup(int n, ...) {
   free(list);
 }
 
+/*
+** Memoized parsers keep one copy of each result per input
+** offset and hand out further copies when the same offset
+** is tried again, so the copy function must produce a value
+** that the destructor can free independently.
+*/
+
+mpc_parser_t *mpc_memoize(mpc_parser_t *p, mpc_copy_t c, mpc_dtor_t d) {
+  p->memo_copy = c;
+  p->memo_dtor = d;
+  return p;
+}
+
+void mpc_memo_stats(mpc_parser_t *p, mpc_memo_stats_t *s) {
+  *s = p->memo;
+}
+
 mpc_parser_t *mpc_pass(void) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_PASS;
@@ -1676,6 +2697,7 @@ mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_LIFT;
   p->data.lift.lf = lf;
+  p->span = lf == mpcf_ctor_str ? MPC_SPAN_TEXT : MPC_SPAN_NONE;
   return p;
 }
 
@@ -1695,6 +2717,7 @@ mpc_parser_t *mpc_state(void) {
 mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_EXPECT;
+  p->span = a->span;
   p->data.expect.x = a;
   p->data.expect.m = malloc(strlen(expected) + 1);
   strcpy(p->data.expect.m, expected);
@@ -1737,6 +2760,7 @@ mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
   va_end(va);
 
   buffer = realloc(buffer, strlen(buffer) + 1);
+  p->span = a->span;
   p->data.expect.x = a;
   p->data.expect.m = buffer;
   return p;
@@ -1749,12 +2773,14 @@ mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
 mpc_parser_t *mpc_any(void) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_ANY;
+  p->span = MPC_SPAN_TEXT;
   return mpc_expect(p, "any character");
 }
 
 mpc_parser_t *mpc_char(char c) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_SINGLE;
+  p->span = MPC_SPAN_TEXT;
   p->data.single.x = c;
   return mpc_expectf(p, "'%c'", c);
 }
@@ -1762,6 +2788,7 @@ mpc_parser_t *mpc_char(char c) {
 mpc_parser_t *mpc_range(char s, char e) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_RANGE;
+  p->span = MPC_SPAN_TEXT;
   p->data.range.x = s;
   p->data.range.y = e;
   return mpc_expectf(p, "character between '%c' and '%c'", s, e);
@@ -1770,6 +2797,7 @@ mpc_parser_t *mpc_range(char s, char e) {
 mpc_parser_t *mpc_oneof(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_ONEOF;
+  p->span = MPC_SPAN_TEXT;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
   return mpc_expectf(p, "one of '%s'", s);
@@ -1778,6 +2806,7 @@ mpc_parser_t *mpc_oneof(const char *s) {
 mpc_parser_t *mpc_noneof(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NONEOF;
+  p->span = MPC_SPAN_TEXT;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
   return mpc_expectf(p, "none of '%s'", s);
@@ -1787,6 +2816,7 @@ mpc_parser_t *mpc_noneof(const char *s) {
 mpc_parser_t *mpc_satisfy(int(*f)(char)) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_SATISFY;
+  p->span = MPC_SPAN_TEXT;
   p->data.satisfy.f = f;
   return mpc_expectf(p, "character satisfying function %p", f);
 }
@@ -1794,6 +2824,7 @@ mpc_parser_t *mpc_satisfy(int(*f)(char)) {
 mpc_parser_t *mpc_string(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_STRING;
+  p->span = MPC_SPAN_TEXT;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
   return mpc_expectf(p, "\"%s\"", s);
@@ -1888,6 +2919,7 @@ mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   p->data.not.x = a;
   p->data.not.dx = da;
   p->data.not.lf = lf;
+  if (lf == mpcf_ctor_str && da == free) { p->span = mpc_span_join(a->span, MPC_SPAN_TEXT); }
   return p;
 }
 
@@ -1900,6 +2932,7 @@ mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
   p->type = MPC_TYPE_MAYBE;
   p->data.not.x = a;
   p->data.not.lf = lf;
+  if (lf == mpcf_ctor_str) { p->span = mpc_span_join(a->span, MPC_SPAN_TEXT); }
   return p;
 }
 
@@ -1912,6 +2945,7 @@ mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
   p->type = MPC_TYPE_MANY;
   p->data.repeat.x = a;
   p->data.repeat.f = f;
+  if (f == mpcf_strfold) { p->span = mpc_span_join(a->span, MPC_SPAN_FOLD); }
   return p;
 }
 
@@ -1920,6 +2954,7 @@ mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
   p->type = MPC_TYPE_MANY1;
   p->data.repeat.x = a;
   p->data.repeat.f = f;
+  if (f == mpcf_strfold) { p->span = mpc_span_join(a->span, MPC_SPAN_FOLD); }
   return p;
 }
 
@@ -1944,9 +2979,12 @@ mpc_parser_t *mpc_or(int n, ...) {
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
 
+  p->span = n > 0 ? MPC_SPAN_TEXT : MPC_SPAN_NONE;
+
   va_start(va, n);
   for (i = 0; i < n; i++) {
     p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+    p->span = mpc_span_join(p->span, p->data.or.xs[i]->span);
   }
   va_end(va);
 
@@ -1966,12 +3004,16 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
   p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
   p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
 
+  p->span = f == mpcf_strfold && n > 0 ? MPC_SPAN_FOLD : MPC_SPAN_NONE;
+
   va_start(va, f);
   for (i = 0; i < n; i++) {
     p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+    p->span = mpc_span_join(p->span, p->data.and.xs[i]->span);
   }
   for (i = 0; i < (n-1); i++) {
     p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+    if (p->data.and.dxs[i] != free) { p->span = MPC_SPAN_NONE; }
   }
   va_end(va);
 
@@ -2341,21 +3383,167 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
       }
     }
 
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
-    }
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+
+  }
+
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+
+  free(x);
+  free(range);
+
+  return out;
+}
+
+static void mpc_re_node_delete(mpc_re_node_t *x) {
+  int i;
+  if (x == NULL) { return; }
+  for (i = 0; i < x->n; i++) { mpc_re_node_delete(x->xs[i]); }
+  free(x->xs);
+  free(x->str);
+  free(x);
+}
+
+static mpc_re_node_t *mpc_re_node_new(int type, int n) {
+  mpc_re_node_t *x = calloc(1, sizeof(mpc_re_node_t));
+  x->type = type;
+  x->n = n;
+  x->xs = n ? calloc(n, sizeof(mpc_re_node_t*)) : NULL;
+  x->width0 = type == MPC_RE_EMPTY || type == MPC_RE_SOI
+           || type == MPC_RE_EOI   || type == MPC_RE_ANCHOR || type == MPC_RE_NOT;
+  return x;
+}
+
+/* Byte table for a single character parser. The input terminator never matches. */
+static mpc_re_node_t *mpc_re_compile_class(mpc_parser_t *p) {
+
+  int c;
+  char x;
+  mpc_re_node_t *r = mpc_re_node_new(MPC_RE_CLASS, 0);
+
+  for (c = 1; c < 256; c++) {
+    x = (char)c;
+    switch (p->type) {
+      case MPC_TYPE_ANY:     r->set[c] = 1; break;
+      case MPC_TYPE_SINGLE:  r->set[c] = x == p->data.single.x; break;
+      case MPC_TYPE_RANGE:   r->set[c] = x >= p->data.range.x && x <= p->data.range.y; break;
+      case MPC_TYPE_ONEOF:   r->set[c] = strchr(p->data.string.x, x) != 0; break;
+      case MPC_TYPE_NONEOF:  r->set[c] = strchr(p->data.string.x, x) == 0; break;
+      case MPC_TYPE_SATISFY: r->set[c] = p->data.satisfy.f(x) != 0; break;
+      default: break;
+    }
+  }
+
+  return r;
+}
+
+/*
+** Compiles the combinator tree built by mpc_re_mode. Returns
+** NULL if it contains anything the compiled form cannot
+** reproduce exactly, such as counted repetition (which does
+** not rewind on failure) or a fold other than the string
+** folds mpc_re uses. Also computes the height of the tree so
+** the parser can tell when the combinators would have hit
+** the recursion limit.
+*/
+
+static mpc_re_node_t *mpc_re_compile(mpc_parser_t *p, int *height) {
+
+  int i, h, type;
+  mpc_re_node_t *r = NULL;
+  mpc_re_node_t *x;
+
+  *height = 1;
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+      return mpc_re_compile_class(p);
+
+    case MPC_TYPE_STRING:
+      r = mpc_re_node_new(MPC_RE_STRING, 0);
+      r->str = malloc(strlen(p->data.string.x) + 1);
+      strcpy(r->str, p->data.string.x);
+      return r;
 
-  }
+    case MPC_TYPE_PASS: return mpc_re_node_new(MPC_RE_EMPTY, 0);
+    case MPC_TYPE_SOI:  return mpc_re_node_new(MPC_RE_SOI, 0);
+    case MPC_TYPE_EOI:  return mpc_re_node_new(MPC_RE_EOI, 0);
 
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+    case MPC_TYPE_LIFT:
+      if (p->data.lift.lf != mpcf_ctor_str) { return NULL; }
+      return mpc_re_node_new(MPC_RE_EMPTY, 0);
 
-  free(x);
-  free(range);
+    case MPC_TYPE_ANCHOR:
+      r = mpc_re_node_new(MPC_RE_ANCHOR, 0);
+      r->f = p->data.anchor.f;
+      return r;
 
-  return out;
+    case MPC_TYPE_EXPECT:
+      r = mpc_re_compile(p->data.expect.x, &h);
+      *height = h + 1;
+      return r;
+
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      if (p->data.not.lf != mpcf_ctor_str) { return NULL; }
+      x = mpc_re_compile(p->data.not.x, &h);
+      if (x == NULL) { return NULL; }
+      r = mpc_re_node_new(p->type == MPC_TYPE_NOT ? MPC_RE_NOT : MPC_RE_MAYBE, 1);
+      r->xs[0] = x;
+      *height = h + 1;
+      return r;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return NULL; }
+      x = mpc_re_compile(p->data.repeat.x, &h);
+      if (x == NULL) { return NULL; }
+      *height = h + 1;
+      if (x->type == MPC_RE_CLASS) {
+        x->type = p->type == MPC_TYPE_MANY ? MPC_RE_SPAN : MPC_RE_SPAN1;
+        return x;
+      }
+      r = mpc_re_node_new(p->type == MPC_TYPE_MANY ? MPC_RE_MANY : MPC_RE_MANY1, 1);
+      r->xs[0] = x;
+      return r;
+
+    case MPC_TYPE_OR:
+    case MPC_TYPE_AND:
+      type = p->type == MPC_TYPE_OR ? MPC_RE_OR : MPC_RE_AND;
+      r = mpc_re_node_new(type, type == MPC_RE_OR ? p->data.or.n : p->data.and.n);
+      r->width0 = 1;
+      for (i = 0; i < r->n; i++) {
+        r->xs[i] = mpc_re_compile(type == MPC_RE_OR ? p->data.or.xs[i] : p->data.and.xs[i], &h);
+        if (r->xs[i] == NULL) { mpc_re_node_delete(r); return NULL; }
+        r->width0 = r->width0 && r->xs[i]->width0;
+        if (h + 1 > *height) { *height = h + 1; }
+      }
+      if (type == MPC_RE_OR || p->data.and.f == mpcf_strfold) { return r; }
+
+      /* A pair that keeps one result must not drop consumed input. */
+      if (r->n == 2
+      && (p->data.and.f == mpcf_fst || p->data.and.f == mpcf_fst_free)
+      &&  r->xs[1]->width0) { return r; }
+      if (r->n == 2
+      && (p->data.and.f == mpcf_snd || p->data.and.f == mpcf_snd_free)
+      &&  r->xs[0]->width0) { return r; }
+
+      mpc_re_node_delete(r);
+      return NULL;
+
+    default: return NULL;
+  }
 }
 
 mpc_parser_t *mpc_re(const char *re) {
@@ -2365,9 +3553,11 @@ mpc_parser_t *mpc_re(const char *re) {
 mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   char *err_msg;
-  mpc_parser_t *err_out;
+  mpc_parser_t *err_out, *p;
   mpc_result_t r;
   mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+  mpc_re_node_t *prog;
+  int height;
 
   Regex  = mpc_new("regex");
   Term   = mpc_new("term");
@@ -2425,6 +3615,17 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   mpc_optimise(r.output);
 
+  prog = mpc_re_compile(r.output, &height);
+  if (prog) {
+    p = mpc_undefined();
+    p->type = MPC_TYPE_REGEX;
+    p->span = ((mpc_parser_t*)r.output)->span ? MPC_SPAN_TEXT : MPC_SPAN_NONE;
+    p->data.regex.x = r.output;
+    p->data.regex.prog = prog;
+    p->data.regex.height = height;
+    return p;
+  }
+
   return r.output;
 
 }
@@ -2655,16 +3856,20 @@ mpc_val_t *mpcf_all_free(int n, mpc_val_t** xs) {
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
   int i;
-  size_t l = 0;
+  size_t l, m;
 
   if (n == 0) { return calloc(1, 1); }
 
-  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+  l = strlen(xs[0]);
+  for (i = 1, m = l; i < n; i++) { m += strlen(xs[i]); }
 
-  xs[0] = realloc(xs[0], l + 1);
+  xs[0] = realloc(xs[0], m + 1);
 
   for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+    m = strlen(xs[i]);
+    memcpy((char*)xs[0] + l, xs[i], m + 1);
+    l += m;
+    free(xs[i]);
   }
 
   return xs[0];
@@ -2758,6 +3963,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_REGEX)    { mpc_print_unretained(p->data.regex.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2872,28 +4078,52 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
+  free(a->children);
+  free(a->tag);
+  free(a->contents);
+  free(a);
+}
+
+/* Arena nodes go with their whole arena, which only their root can release. */
+static int mpc_ast_delete_arena(mpc_ast_t *a) {
+  if (a->arena == NULL) { return 0; }
+  if (a->arena->root == a) { mpc_ast_arena_delete(a->arena); }
+  return 1;
+}
+
+/*
+** Nodes waiting to be freed are kept on a heap stack so
+** that trees of deeply nested input can be deleted too.
+*/
+
 void mpc_ast_delete(mpc_ast_t *a) {
 
-  int i;
+  mpc_ast_t **pending;
+  int num = 0, slots = 16, i;
 
   if (a == NULL) { return; }
+  if (mpc_ast_delete_arena(a)) { return; }
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
-  }
+  pending = malloc(sizeof(mpc_ast_t*) * slots);
+  pending[num++] = a;
 
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  while (num > 0) {
+    a = pending[--num];
+    if (mpc_ast_delete_arena(a)) { continue; }
+    if (num + a->children_num > slots) {
+      slots = num + a->children_num + slots;
+      pending = realloc(pending, sizeof(mpc_ast_t*) * slots);
+    }
+    for (i = a->children_num - 1; i >= 0; i--) {
+      if (a->children[i]) { pending[num++] = a->children[i]; }
+    }
+    mpc_ast_delete_no_children(a);
+  }
 
-}
+  free(pending);
 
-static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
 }
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
@@ -2910,10 +4140,81 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   a->children_num = 0;
   a->children = NULL;
+  a->rules = 0;
+  a->children_slots = 0;
+  a->arena = NULL;
   return a;
 
 }
 
+static mpc_ast_t *mpc_ast_new_in(mpc_ast_arena_t *arena, const char *tag, const char *contents) {
+
+  mpc_ast_t *a;
+
+  if (arena == NULL) { return mpc_ast_new(tag, contents); }
+
+  a = mpc_ast_arena_alloc(arena, sizeof(mpc_ast_t));
+  a->tag = mpc_ast_arena_strdup(arena, tag);
+  a->contents = mpc_ast_arena_strdup(arena, contents);
+  a->state = mpc_state_new();
+  a->children_num = 0;
+  a->children = NULL;
+  a->rules = 0;
+  a->children_slots = 0;
+  a->arena = arena;
+  return a;
+
+}
+
+/* Child arrays grow geometrically, arena ones by moving to a new block. */
+static void mpc_ast_reserve(mpc_ast_t *r, int n) {
+
+  mpc_ast_t **cs;
+
+  if (n <= r->children_slots) { return; }
+
+  if (r->arena) {
+    cs = mpc_ast_arena_alloc(r->arena, sizeof(mpc_ast_t*) * n);
+    if (r->children_num) { memcpy(cs, r->children, sizeof(mpc_ast_t*) * r->children_num); }
+    r->children = cs;
+  } else {
+    r->children = realloc(r->children, sizeof(mpc_ast_t*) * n);
+  }
+
+  r->children_slots = n;
+}
+
+static void mpc_ast_push_child(mpc_ast_t *r, mpc_ast_t *a) {
+  if (r->children_num >= r->children_slots) {
+    mpc_ast_reserve(r, r->children_num ? r->children_num * 2 : 4);
+  }
+  r->children[r->children_num++] = a;
+}
+
+static mpc_ast_t *mpc_ast_copy_in(mpc_ast_arena_t *arena, mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *r;
+
+  if (a == NULL) { return a; }
+
+  r = mpc_ast_new_in(arena, a->tag, a->contents);
+  r->state = a->state;
+  r->rules = a->rules;
+  mpc_ast_reserve(r, a->children_num);
+  r->children_num = a->children_num;
+
+  for (i = 0; i < a->children_num; i++) {
+    r->children[i] = mpc_ast_copy_in(arena, a->children[i]);
+  }
+
+  return r;
+}
+
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  return mpc_ast_copy_in(NULL, a);
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2940,7 +4241,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_in(a->arena, ">", "");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2961,15 +4262,25 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-  r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-  r->children[r->children_num-1] = a;
+  mpc_ast_push_child(r, a);
+  if (r->arena && a && a->arena != r->arena) { mpc_ast_arena_adopt(r->arena, a); }
   return r;
 }
 
+/* Arena tags are never resized in place, the old one is left for the arena to release. */
+static char *mpc_ast_realloc_tag(mpc_ast_t *a, size_t n) {
+  char *t;
+  size_t m;
+  if (a->arena == NULL) { return realloc(a->tag, n); }
+  m = strlen(a->tag) + 1;
+  t = mpc_ast_arena_alloc(a->arena, n);
+  memcpy(t, a->tag, m < n ? m : n);
+  return t;
+}
+
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  a->tag = mpc_ast_realloc_tag(a, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
   memmove(a->tag + strlen(t), "|", 1);
@@ -2978,18 +4289,58 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
+  a->tag = mpc_ast_realloc_tag(a, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
+  a->tag = mpc_ast_realloc_tag(a, strlen(t) + 1);
   strcpy(a->tag, t);
+  a->rules = 0;
   return a;
 }
 
+/*
+** Rules referred to in `mpca_lang` grammars are numbered
+** from 1 in the order they are first referred to. The first
+** ones each have a bit in `rules`, later ones are looked up
+** in the tag.
+*/
+
+static int mpc_rule_num = 0;
+
+#define MPC_AST_RULE_BITS ((int)sizeof(unsigned long) * 8)
+
+static unsigned long mpc_ast_rule_bit(mpc_parser_t *p) {
+  return p->rule > 0 && p->rule <= MPC_AST_RULE_BITS ? 1UL << (p->rule - 1) : 0;
+}
+
+static mpc_ast_t *mpc_ast_add_rule(mpc_ast_t *a, mpc_parser_t *p) {
+  if (a == NULL) { return a; }
+  a->rules |= mpc_ast_rule_bit(p);
+  return mpc_ast_add_tag(a, p->name);
+}
+
+int mpc_ast_has_rule(mpc_ast_t *ast, mpc_parser_t *rule) {
+
+  const char *t;
+  size_t n;
+
+  if (rule->rule <= 0 || rule->name == NULL) { return 0; }
+  if (rule->rule <= MPC_AST_RULE_BITS) { return (ast->rules & mpc_ast_rule_bit(rule)) != 0; }
+
+  n = strlen(rule->name);
+  t = ast->tag;
+  while (1) {
+    if (strncmp(t, rule->name, n) == 0 && (t[n] == '|' || t[n] == '\0')) { return 1; }
+    t = strchr(t, '|');
+    if (t == NULL) { return 0; }
+    t++;
+  }
+}
+
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
   a->state = s;
@@ -3198,10 +4549,17 @@ void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
   }
 }
 
+/* Children of a node in the same arena are already owned by it. */
+static void mpc_ast_move_child(mpc_ast_t *r, mpc_ast_t *a, mpc_ast_t *c) {
+  if (r->arena && r->arena == a->arena) { mpc_ast_push_child(r, c); }
+  else { mpc_ast_add_child(r, c); }
+}
+
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
 
-  int i, j;
+  int i, j, m = 0;
   mpc_ast_t** as = (mpc_ast_t**)xs;
+  mpc_ast_arena_t *arena = NULL;
   mpc_ast_t *r;
 
   if (n == 0) { return NULL; }
@@ -3209,7 +4567,14 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
 
-  r = mpc_ast_new(">", "");
+  for (i = 0; i < n; i++) {
+    if (as[i] == NULL) { continue; }
+    if (arena == NULL) { arena = as[i]->arena; }
+    m += as[i]->children_num >= 2 ? as[i]->children_num : 1;
+  }
+
+  r = mpc_ast_new_in(arena, ">", "");
+  mpc_ast_reserve(r, m);
 
   for (i = 0; i < n; i++) {
 
@@ -3218,11 +4583,12 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      as[i]->children[0]->rules |= as[i]->rules;
+      mpc_ast_move_child(r, as[i], mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
       mpc_ast_delete_no_children(as[i]);
     } else if (as[i] && as[i]->children_num >= 2) {
       for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
+        mpc_ast_move_child(r, as[i], as[i]->children[j]);
       }
       mpc_ast_delete_no_children(as[i]);
     }
@@ -3501,7 +4867,8 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   free(x);
 
   if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+    if (p->rule == 0) { p->rule = ++mpc_rule_num; }
+    return mpca_state(mpca_root(mpc_apply_to(p, (mpc_apply_to_t)mpc_ast_add_rule, p)));
   } else {
     return mpca_state(mpca_root(p));
   }
@@ -3591,6 +4958,322 @@ mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
   return res;
 }
 
+/*
+** Grammar Analysis
+*/
+
+/*
+** For each parser reachable from the rules given to
+** `mpca_lang` this finds the bytes it can start consuming
+** input with, and whether it can succeed without consuming
+** any. Rules refer to each other, so the sets are grown
+** pass by pass until they stop changing. A last pass gives
+** every choice and repetition a jump table from them.
+**
+** Parsers whose input cannot be known in advance, such as
+** undefined ones or `mpc_satisfy`, are taken to accept any
+** byte, and the terminating NUL never rules anything out.
+*/
+
+typedef struct {
+  unsigned char first[32];
+  int nullable;
+} mpc_first_t;
+
+typedef struct {
+  mpc_parser_t *p;
+  mpc_first_t x;
+  int pass;
+} mpc_first_rule_t;
+
+typedef struct {
+  mpc_first_rule_t *rules;
+  int rules_num;
+  int pass;
+  int changed;
+  int build;
+} mpc_first_st_t;
+
+#define MPC_FIRST_HAS(x, c) ((x)->first[(c) / 8] & (1 << ((c) % 8)))
+#define MPC_FIRST_SET(x, c) ((x)->first[(c) / 8] |= (unsigned char)(1 << ((c) % 8)))
+
+static void mpc_first_union(mpc_first_t *x, const mpc_first_t *y) {
+  int c;
+  for (c = 0; c < 32; c++) { x->first[c] |= y->first[c]; }
+}
+
+static void mpc_first_unretained(mpc_first_st_t *st, mpc_parser_t *p, mpc_first_t *x, int force);
+
+static int mpc_first_find(mpc_first_st_t *st, mpc_parser_t *p) {
+  int k;
+  for (k = 0; k < st->rules_num; k++) {
+    if (st->rules[k].p == p) { return k; }
+  }
+  st->rules = realloc(st->rules, sizeof(mpc_first_rule_t) * (st->rules_num + 1));
+  st->rules[k].p = p;
+  memset(&st->rules[k].x, 0, sizeof(mpc_first_t));
+  st->rules[k].pass = 0;
+  st->rules_num++;
+  return k;
+}
+
+/* A rule already visited in this pass, possibly one still being visited, gives its sets so far. */
+static void mpc_first_rule(mpc_first_st_t *st, mpc_parser_t *p, mpc_first_t *x) {
+
+  mpc_first_rule_t *r;
+  int k = mpc_first_find(st, p);
+
+  if (st->rules[k].pass == st->pass) { *x = st->rules[k].x; return; }
+  st->rules[k].pass = st->pass;
+  p->analysed = 1;
+
+  mpc_first_unretained(st, p, x, 1);
+
+  r = &st->rules[k];
+  mpc_first_union(x, &r->x);
+  x->nullable = x->nullable || r->x.nullable;
+  if (memcmp(x, &r->x, sizeof(mpc_first_t)) != 0) {
+    r->x = *x;
+    st->changed = 1;
+  }
+}
+
+static void mpc_jump_build(mpc_jump_t **jump, mpc_first_t *xs, int n) {
+
+  int c, j, k, useful = 0;
+  mpc_jump_t *t;
+
+  free(*jump);
+  *jump = NULL;
+  if (n > 255) { return; }
+
+  t = malloc(sizeof(mpc_jump_t) + sizeof(t->next[0]) * (n + 1));
+  t->gen = mpc_jump_gen;
+
+  for (c = 0; c < 256; c++) {
+    k = n;
+    for (j = n-1; j >= 0; j--) {
+      t->next[j+1][c] = (unsigned char)k;
+      if (c == 0 || xs[j].nullable || MPC_FIRST_HAS(&xs[j], c)) { k = j; }
+      else { useful = 1; }
+    }
+    t->next[0][c] = (unsigned char)k;
+  }
+
+  if (useful) { *jump = t; } else { free(t); }
+}
+
+static void mpc_first_unretained(mpc_first_st_t *st, mpc_parser_t *p, mpc_first_t *x, int force) {
+
+  int c, j;
+  mpc_first_t y, *xs;
+
+  if (p->retained && !force) { mpc_first_rule(st, p, x); return; }
+
+  memset(x, 0, sizeof(mpc_first_t));
+
+  switch (p->type) {
+
+    case MPC_TYPE_UNDEFINED:
+      memset(x->first, 0xFF, sizeof(x->first));
+      x->nullable = 1;
+      break;
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      memset(x->first, 0xFF, sizeof(x->first));
+      break;
+
+    case MPC_TYPE_SINGLE: MPC_FIRST_SET(x, (unsigned char)p->data.single.x); break;
+
+    case MPC_TYPE_RANGE:
+      for (c = 0; c < 256; c++) {
+        if ((char)c >= p->data.range.x && (char)c <= p->data.range.y) { MPC_FIRST_SET(x, c); }
+      }
+      break;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (c = 1; c < 256; c++) {
+        if ((strchr(p->data.string.x, c) != NULL) == (p->type == MPC_TYPE_ONEOF)) { MPC_FIRST_SET(x, c); }
+      }
+      break;
+
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0]) { MPC_FIRST_SET(x, (unsigned char)p->data.string.x[0]); }
+      else { x->nullable = 1; }
+      break;
+
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+      x->nullable = 1;
+      break;
+
+    case MPC_TYPE_REGEX:      mpc_first_unretained(st, p->data.regex.x, x, 0); break;
+    case MPC_TYPE_EXPECT:     mpc_first_unretained(st, p->data.expect.x, x, 0); break;
+    case MPC_TYPE_APPLY:      mpc_first_unretained(st, p->data.apply.x, x, 0); break;
+    case MPC_TYPE_APPLY_TO:   mpc_first_unretained(st, p->data.apply_to.x, x, 0); break;
+    case MPC_TYPE_PREDICT:    mpc_first_unretained(st, p->data.predict.x, x, 0); break;
+    case MPC_TYPE_CHECK:      mpc_first_unretained(st, p->data.check.x, x, 0); break;
+    case MPC_TYPE_CHECK_WITH: mpc_first_unretained(st, p->data.check_with.x, x, 0); break;
+
+    /* A failed `not` child that consumed input without rewinding leaves it consumed. */
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      mpc_first_unretained(st, p->data.not.x, x, 0);
+      x->nullable = 1;
+      break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      mpc_first_unretained(st, p->data.repeat.x, x, 0);
+      if (st->build) { mpc_jump_build(&p->data.repeat.jump, x, 1); }
+      if (p->type == MPC_TYPE_MANY) { x->nullable = 1; }
+      break;
+
+    case MPC_TYPE_COUNT:
+      mpc_first_unretained(st, p->data.repeat.x, x, 0);
+      if (p->data.repeat.n == 0) { x->nullable = 1; }
+      break;
+
+    case MPC_TYPE_OR:
+      xs = malloc(sizeof(mpc_first_t) * (p->data.or.n + 1));
+      x->nullable = p->data.or.n == 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        mpc_first_unretained(st, p->data.or.xs[j], &xs[j], 0);
+        mpc_first_union(x, &xs[j]);
+        x->nullable = x->nullable || xs[j].nullable;
+      }
+      if (st->build && p->data.or.n > 0) { mpc_jump_build(&p->data.or.jump, xs, p->data.or.n); }
+      free(xs);
+      break;
+
+    case MPC_TYPE_AND:
+      x->nullable = 1;
+      for (j = 0; j < p->data.and.n; j++) {
+        mpc_first_unretained(st, p->data.and.xs[j], &y, 0);
+        if (x->nullable) { mpc_first_union(x, &y); }
+        x->nullable = x->nullable && y.nullable;
+      }
+      break;
+
+    default: break;
+  }
+}
+
+static void mpc_first_print_byte(FILE *fp, int c) {
+  if (isgraph(c) && !strchr("-\\]", c)) { fprintf(fp, "%c", c); }
+  else { fprintf(fp, "\\x%02x", c); }
+}
+
+/* Prints a set of bytes as a character class, as in `[(0-9A-Z]`. */
+static void mpc_first_print(FILE *fp, const mpc_first_t *x) {
+
+  int c, d;
+
+  fprintf(fp, "[");
+  for (c = 1; c < 256; c = d) {
+    if (!MPC_FIRST_HAS(x, c)) { d = c + 1; continue; }
+    for (d = c + 1; d < 256 && MPC_FIRST_HAS(x, d); d++);
+    if (c == 1 && d == 256) { fprintf(fp, "any"); break; }
+    mpc_first_print_byte(fp, c);
+    if (d - c > 2) { fprintf(fp, "-"); }
+    if (d - c > 1) { mpc_first_print_byte(fp, d-1); }
+  }
+  fprintf(fp, "]");
+}
+
+/* Counts the jump tables in the body of a rule, and the choices where the next byte always picks one alternative. */
+static void mpc_first_count(mpc_parser_t *p, int force, int *choices, int *predictive, int *repeats) {
+
+  int c, j;
+  mpc_jump_t *t;
+
+  if (p->retained && !force) { return; }
+
+  switch (p->type) {
+    case MPC_TYPE_REGEX:      mpc_first_count(p->data.regex.x, 0, choices, predictive, repeats); break;
+    case MPC_TYPE_EXPECT:     mpc_first_count(p->data.expect.x, 0, choices, predictive, repeats); break;
+    case MPC_TYPE_APPLY:      mpc_first_count(p->data.apply.x, 0, choices, predictive, repeats); break;
+    case MPC_TYPE_APPLY_TO:   mpc_first_count(p->data.apply_to.x, 0, choices, predictive, repeats); break;
+    case MPC_TYPE_PREDICT:    mpc_first_count(p->data.predict.x, 0, choices, predictive, repeats); break;
+    case MPC_TYPE_CHECK:      mpc_first_count(p->data.check.x, 0, choices, predictive, repeats); break;
+    case MPC_TYPE_CHECK_WITH: mpc_first_count(p->data.check_with.x, 0, choices, predictive, repeats); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      mpc_first_count(p->data.not.x, 0, choices, predictive, repeats); break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.jump) { (*repeats)++; }
+      mpc_first_count(p->data.repeat.x, 0, choices, predictive, repeats);
+      break;
+
+    case MPC_TYPE_OR:
+      t = p->data.or.jump;
+      if (t) {
+        (*choices)++;
+        for (c = 1; c < 256; c++) {
+          j = t->next[0][c];
+          if (j < p->data.or.n && t->next[j+1][c] < p->data.or.n) { break; }
+        }
+        if (c == 256) { (*predictive)++; }
+      }
+      for (j = 0; j < p->data.or.n; j++) { mpc_first_count(p->data.or.xs[j], 0, choices, predictive, repeats); }
+      break;
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) { mpc_first_count(p->data.and.xs[j], 0, choices, predictive, repeats); }
+      break;
+
+    default: break;
+  }
+}
+
+static void mpc_analyse(mpc_parser_t **ps, int n, int debug) {
+
+  int k, choices, predictive, repeats;
+  mpc_first_t x;
+  mpc_first_st_t st;
+
+  st.rules = NULL;
+  st.rules_num = 0;
+  st.pass = 0;
+  st.build = 0;
+
+  do {
+    st.changed = 0;
+    st.pass++;
+    for (k = 0; k < n; k++) { mpc_first_unretained(&st, ps[k], &x, 0); }
+  } while (st.changed);
+
+  st.build = 1;
+  st.pass++;
+  for (k = 0; k < n; k++) { mpc_first_unretained(&st, ps[k], &x, 0); }
+
+  if (debug) {
+    for (k = 0; k < n; k++) {
+      choices = predictive = repeats = 0;
+      mpc_first_unretained(&st, ps[k], &x, 0);
+      mpc_first_count(ps[k], 1, &choices, &predictive, &repeats);
+      fprintf(stderr, "%s: first ", ps[k]->name);
+      mpc_first_print(stderr, &x);
+      if (x.nullable) { fprintf(stderr, " or empty"); }
+      fprintf(stderr, "; jump tables for %i choices (%i predictive) and %i repetitions\n", choices, predictive, repeats);
+    }
+  }
+
+  free(st.rules);
+}
+
+#undef MPC_FIRST_HAS
+#undef MPC_FIRST_SET
+
 typedef struct {
   char *ident;
   char *name;
@@ -3644,14 +5327,25 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
   mpc_parser_t *left;
+  mpc_parser_t **rules;
+  int n = 0;
+
+  while (stmts[n]) { n++; }
+  rules = malloc(sizeof(mpc_parser_t*) * (n + 1));
+  n = 0;
 
   while(*stmts) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
+    rules[n++] = left;
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
+    left->ast = 1;
+    if (st->flags & MPCA_LANG_PACKRAT) {
+      mpc_memoize(left, (mpc_copy_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete);
+    }
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
@@ -3660,6 +5354,9 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
 
   free(x);
 
+  mpc_analyse(rules, n, st->flags & MPCA_LANG_DEBUG);
+  free(rules);
+
   return NULL;
 }
 
@@ -3844,6 +5541,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_REGEX)    { return 1 + mpc_nodecount_unretained(p->data.regex.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3896,6 +5594,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_REGEX)      { mpc_optimise_unretained(p->data.regex.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -3926,6 +5625,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       n = p->data.or.n; m = t->data.or.n;
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      free(p->data.or.jump); free(t->data.or.jump);
+      p->data.or.jump = NULL;
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
       free(t->data.or.xs); free(t->name); free(t);
       continue;
@@ -3939,6 +5640,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       n = p->data.or.n; m = t->data.or.n;
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      free(p->data.or.jump); free(t->data.or.jump);
+      p->data.or.jump = NULL;
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
       free(t->data.or.xs); free(t->name); free(t);
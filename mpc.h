@@ -71,12 +71,26 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/* Like mpc_parse, but reads string in place, which must stay valid until it returns. */
+int mpc_parse_borrowed(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+
+char *mpc_map_file(const char *filename, size_t *length);
+void mpc_unmap_file(char *string, size_t length);
+
+/*
+** Sets the nesting limit for parsing, 0 for none. Returns the
+** previous limit. A parse that fails after reaching the limit
+** reports "Maximum recursion depth exceeded!".
+*/
+int mpc_set_max_depth(int depth);
+
 /*
 ** Function Types
 */
 
 typedef void(*mpc_dtor_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_ctor_t)(void);
+typedef mpc_val_t*(*mpc_copy_t)(mpc_val_t*);
 
 typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
@@ -97,6 +111,19 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p);
 void mpc_delete(mpc_parser_t *p);
 void mpc_cleanup(int n, ...);
 
+/*
+** Packrat Memoization
+*/
+
+typedef struct {
+  long lookups;
+  long hits;
+  long stores;
+} mpc_memo_stats_t;
+
+mpc_parser_t *mpc_memoize(mpc_parser_t *p, mpc_copy_t c, mpc_dtor_t d);
+void mpc_memo_stats(mpc_parser_t *p, mpc_memo_stats_t *s);
+
 /*
 ** Basic Parsers
 */
@@ -280,12 +307,28 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+/*
+** `rules` has a bit for each `mpca_lang` rule the node was
+** matched by, for `mpc_ast_has_rule`. The tag holds the same
+** rule names as a string for printing.
+**
+** Trees returned by parsing with an `mpca_lang` rule live in
+** an arena owned by their root. `mpc_ast_delete` on the root
+** releases the whole tree at once and on any other node of
+** it does nothing, so nodes must not be kept past the root.
+*/
+
+struct mpc_ast_arena_t;
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  unsigned long rules;
+  int children_slots;
+  struct mpc_ast_arena_t *arena;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -297,6 +340,8 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
+
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
@@ -306,6 +351,8 @@ int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb);
 mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag);
 mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb);
 
+int mpc_ast_has_rule(mpc_ast_t *ast, mpc_parser_t *rule);
+
 typedef enum {
   mpc_ast_trav_order_pre,
   mpc_ast_trav_order_post
@@ -353,7 +400,9 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4,
+  MPCA_LANG_DEBUG                = 8
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);